@@ -0,0 +1,460 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+/*
+simplefs-bench formats fresh images of several sizes and times the
+filesystem on each: mount time against the number of inodes in use,
+create and delete rates, sequential and random reads and writes at
+several I/O sizes, and small-file against large-file workloads.
+
+Every test reseeds its own random number generator from the -s seed,
+so two runs with the same seed do exactly the same operations and can
+be compared directly.  Latencies are per call, in microseconds.
+*/
+
+// the largest file the original format can hold; large filesystems are
+// only limited by the image
+#define MAX_FILE_BYTES ((5+1024)*DISK_BLOCK_SIZE)
+
+static const int io_sizes[] = { 512, 4096, 65536 };
+#define NIO_SIZES (int)(sizeof(io_sizes)/sizeof(io_sizes[0]))
+
+static const char *image_dir = "/tmp";
+static const char *format = "text";
+static int features = 0;
+static int reps = 10;
+static uint64_t seed = 1;
+static uint64_t rng;
+static FILE *out;
+
+struct bench_run {
+	int nblocks;
+	const char *test;
+	char param[64];
+	double *latency;
+	int ops;
+	int errors;
+	long bytes;
+	double start;
+	double seconds;
+	long reads;
+	long writes;
+};
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/* splitmix64, so results do not depend on the C library's rand() */
+
+static uint64_t rng_next()
+{
+	uint64_t z = (rng += 0x9e3779b97f4a7c15ull);
+	z = (z^(z>>30))*0xbf58476d1ce4e5b9ull;
+	z = (z^(z>>27))*0x94d049bb133111ebull;
+	return z^(z>>31);
+}
+
+static void rng_seed( const char *test, int param )
+{
+	rng = seed;
+	while(*test) rng = rng*31 + *test++;
+	rng = rng*31 + param;
+}
+
+static void rng_fill( char *buffer, long size )
+{
+	long i;
+	for(i=0;i+8<=size;i+=8) {
+		uint64_t word = rng_next();
+		memcpy(buffer+i,&word,8);
+	}
+	for(;i<size;i++) buffer[i] = rng_next();
+}
+
+static int image_open( int nblocks )
+{
+	char path[1024];
+
+	fs_unmount();
+	disk_close();
+	snprintf(path,sizeof(path),"%s/simplefs-bench.%d",image_dir,nblocks);
+	unlink(path);
+
+	if(!disk_init(path,nblocks)) {
+		fprintf(stderr,"couldn't initialize %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+	if(!fs_format_features(features) || !fs_mount()) {
+		fprintf(stderr,"couldn't format %s\n",path);
+		return 0;
+	}
+	return 1;
+}
+
+static void image_remove( int nblocks )
+{
+	char path[1024];
+
+	fs_unmount();
+	disk_close();
+	snprintf(path,sizeof(path),"%s/simplefs-bench.%d",image_dir,nblocks);
+	unlink(path);
+}
+
+/* usable inodes and data blocks of a freshly formatted image */
+
+static int image_inodes( int nblocks )
+{
+	int ninodeblocks = nblocks/10 + (nblocks%10 ? 1 : 0);
+	return ninodeblocks*128 - 1;
+}
+
+static int image_data_blocks( int nblocks )
+{
+	// leave room for the inode table and any feature tables
+	return nblocks - nblocks/10 - 1 - (features ? nblocks/256 + 2 : 0);
+}
+
+static void run_begin( struct bench_run *r, int nblocks, const char *test, int maxops )
+{
+	memset(r,0,sizeof(*r));
+	r->nblocks = nblocks;
+	r->test = test;
+	r->latency = malloc((maxops>0 ? maxops : 1)*sizeof(double));
+	r->reads = disk_reads();
+	r->writes = disk_writes();
+	r->start = now();
+}
+
+static void run_sample( struct bench_run *r, double start, int ok, long bytes )
+{
+	r->latency[r->ops++] = (now()-start)*1e6;
+	if(ok) {
+		r->bytes += bytes;
+	} else {
+		r->errors++;
+	}
+}
+
+static int compare_double( const void *a, const void *b )
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x<y ? -1 : x>y;
+}
+
+static double percentile( double *sorted, int n, double p )
+{
+	int i = (int)(p*(n-1)+0.5);
+	return n ? sorted[i] : 0;
+}
+
+static void run_end( struct bench_run *r )
+{
+	double *l = r->latency;
+	int n = r->ops;
+	double rate, mbs;
+
+	r->seconds = now()-r->start;
+	r->reads = disk_reads()-r->reads;
+	r->writes = disk_writes()-r->writes;
+
+	qsort(l,n,sizeof(double),compare_double);
+
+	rate = r->seconds>0 ? n/r->seconds : 0;
+	mbs = r->seconds>0 ? r->bytes/r->seconds/1e6 : 0;
+
+	if(!strcmp(format,"csv")) {
+		fprintf(out,"%d,%s,%s,%d,%d,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%ld,%ld\n",
+			r->nblocks,r->test,r->param,n,r->errors,r->seconds,rate,mbs,
+			percentile(l,n,0.5),percentile(l,n,0.9),percentile(l,n,0.99),n ? l[n-1] : 0,
+			r->reads,r->writes);
+	} else {
+		fprintf(out,"%7d %-12s %-14s %7d %4d %12.1f %9.2f %9.1f %9.1f %9.1f %9.1f %9ld %9ld\n",
+			r->nblocks,r->test,r->param,n,r->errors,rate,mbs,
+			percentile(l,n,0.5),percentile(l,n,0.9),percentile(l,n,0.99),n ? l[n-1] : 0,
+			r->reads,r->writes);
+	}
+	fflush(out);
+
+	free(r->latency);
+	r->latency = 0;
+}
+
+/*
+Mount time against the number of inodes in use.  Each inode gets one
+block of data when there is room, so mount has blocks to account for too.
+*/
+
+static void bench_mount( int nblocks )
+{
+	static const int counts[] = { 0, 256, 1024, 4096 };
+	struct bench_run r;
+	char block[DISK_BLOCK_SIZE];
+	int i, j, n, inumber, data;
+	double t;
+
+	for(i=0;i<(int)(sizeof(counts)/sizeof(counts[0]));i++) {
+		n = counts[i];
+		if(n>image_inodes(nblocks)) break;
+		if(!image_open(nblocks)) return;
+
+		rng_seed("mount",n);
+		data = image_data_blocks(nblocks)/2;
+		for(j=0;j<n;j++) {
+			inumber = fs_create();
+			if(inumber>0 && j<data) {
+				rng_fill(block,sizeof(block));
+				fs_write(inumber,block,sizeof(block),0);
+			}
+		}
+
+		run_begin(&r,nblocks,"mount",reps);
+		snprintf(r.param,sizeof(r.param),"inodes=%d",n);
+		for(j=0;j<reps;j++) {
+			t = now();
+			run_sample(&r,t,fs_mount(),0);
+		}
+		run_end(&r);
+	}
+}
+
+static void bench_create_delete( int nblocks )
+{
+	struct bench_run r;
+	int *inodes;
+	int i, n;
+	double t;
+
+	n = image_inodes(nblocks)-1;
+	if(n>1000) n = 1000;
+	if(n<1 || !image_open(nblocks)) return;
+
+	inodes = calloc(n,sizeof(int));
+	if(!inodes) return;
+
+	run_begin(&r,nblocks,"create",n);
+	snprintf(r.param,sizeof(r.param),"files=%d",n);
+	for(i=0;i<n;i++) {
+		t = now();
+		inodes[i] = fs_create();
+		run_sample(&r,t,inodes[i]>0,0);
+	}
+	run_end(&r);
+
+	run_begin(&r,nblocks,"delete",n);
+	snprintf(r.param,sizeof(r.param),"files=%d",n);
+	for(i=0;i<n;i++) {
+		t = now();
+		run_sample(&r,t,inodes[i]>0 && fs_delete(inodes[i]),0);
+	}
+	run_end(&r);
+
+	free(inodes);
+}
+
+/*
+One file, as large as a file or half the image allows, written and read
+front to back and then at random aligned offsets, at each I/O size.
+*/
+
+static void bench_io( int nblocks )
+{
+	struct bench_run r;
+	char *buffer;
+	long filesize;
+	int i, j, n, size, inumber;
+	int64_t offset;
+	double t;
+
+	buffer = malloc(io_sizes[NIO_SIZES-1]);
+	if(!buffer) return;
+
+	for(i=0;i<NIO_SIZES;i++) {
+		size = io_sizes[i];
+		filesize = (long)image_data_blocks(nblocks)/2*DISK_BLOCK_SIZE;
+		if(filesize>MAX_FILE_BYTES && !(features&FS_FEATURE_LARGE)) filesize = MAX_FILE_BYTES;
+		filesize -= filesize%size;
+		n = filesize/size;
+		if(n<1 || !image_open(nblocks)) continue;
+
+		inumber = fs_create();
+		rng_seed("io",size);
+		rng_fill(buffer,size);
+
+		run_begin(&r,nblocks,"seq-write",n);
+		snprintf(r.param,sizeof(r.param),"io=%d",size);
+		for(j=0;j<n;j++) {
+			t = now();
+			run_sample(&r,t,fs_write(inumber,buffer,size,(int64_t)j*size)==size,size);
+		}
+		run_end(&r);
+
+		run_begin(&r,nblocks,"seq-read",n);
+		snprintf(r.param,sizeof(r.param),"io=%d",size);
+		for(j=0;j<n;j++) {
+			t = now();
+			run_sample(&r,t,fs_read(inumber,buffer,size,(int64_t)j*size)==size,size);
+		}
+		run_end(&r);
+
+		run_begin(&r,nblocks,"rand-write",n);
+		snprintf(r.param,sizeof(r.param),"io=%d",size);
+		for(j=0;j<n;j++) {
+			offset = (int64_t)(rng_next()%n)*size;
+			t = now();
+			run_sample(&r,t,fs_write(inumber,buffer,size,offset)==size,size);
+		}
+		run_end(&r);
+
+		run_begin(&r,nblocks,"rand-read",n);
+		snprintf(r.param,sizeof(r.param),"io=%d",size);
+		for(j=0;j<n;j++) {
+			offset = (int64_t)(rng_next()%n)*size;
+			t = now();
+			run_sample(&r,t,fs_read(inumber,buffer,size,offset)==size,size);
+		}
+		run_end(&r);
+	}
+
+	free(buffer);
+}
+
+/*
+Whole-file workloads: many small files or a few large ones, each
+created and written in one call, then read back, then deleted.
+Latencies here are per file.
+*/
+
+static void bench_files( int nblocks, const char *test, int filesize, int maxfiles )
+{
+	struct bench_run r;
+	char *buffer;
+	int *inodes;
+	int i, n, blocks;
+	double t;
+
+	blocks = (filesize+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE;
+	n = image_data_blocks(nblocks)/2/(blocks + (blocks>5));
+	if(n>maxfiles) n = maxfiles;
+	if(n>image_inodes(nblocks)-1) n = image_inodes(nblocks)-1;
+	if(n<1 || !image_open(nblocks)) return;
+
+	buffer = malloc(filesize);
+	inodes = calloc(n,sizeof(int));
+	if(!buffer || !inodes) {
+		free(buffer);
+		free(inodes);
+		return;
+	}
+
+	rng_seed(test,filesize);
+
+	run_begin(&r,nblocks,test,n);
+	snprintf(r.param,sizeof(r.param),"write %dK",filesize/1024);
+	for(i=0;i<n;i++) {
+		rng_fill(buffer,filesize);
+		t = now();
+		inodes[i] = fs_create();
+		run_sample(&r,t,inodes[i]>0 && fs_write(inodes[i],buffer,filesize,0)==filesize,filesize);
+	}
+	run_end(&r);
+
+	run_begin(&r,nblocks,test,n);
+	snprintf(r.param,sizeof(r.param),"read %dK",filesize/1024);
+	for(i=0;i<n;i++) {
+		t = now();
+		run_sample(&r,t,fs_read(inodes[i],buffer,filesize,0)==filesize,filesize);
+	}
+	run_end(&r);
+
+	run_begin(&r,nblocks,test,n);
+	snprintf(r.param,sizeof(r.param),"delete %dK",filesize/1024);
+	for(i=0;i<n;i++) {
+		t = now();
+		run_sample(&r,t,fs_delete(inodes[i]),0);
+	}
+	run_end(&r);
+
+	free(buffer);
+	free(inodes);
+}
+
+int main( int argc, char *argv[] )
+{
+	static char default_sizes[] = "200,2000,20000";
+	char *sizes = default_sizes;
+	char *size;
+	int i, nblocks, saved, null;
+
+	for(i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-s") && i+1<argc) {
+			seed = strtoull(argv[++i],0,0);
+		} else if(!strcmp(argv[i],"-n") && i+1<argc) {
+			sizes = argv[++i];
+		} else if(!strcmp(argv[i],"-r") && i+1<argc) {
+			reps = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-d") && i+1<argc) {
+			image_dir = argv[++i];
+		} else if(!strcmp(argv[i],"-f") && i+1<argc) {
+			features = fs_parse_features(argv[++i]);
+		} else if(!strcmp(argv[i],"-o") && i+1<argc) {
+			format = argv[++i];
+		} else {
+			break;
+		}
+	}
+
+	if(i<argc || reps<1 || features<0 || (strcmp(format,"text") && strcmp(format,"csv"))) {
+		printf("use: %s [-s seed] [-n blocks,blocks,...] [-r mount-reps] [-d image-dir]\n",argv[0]);
+		printf("       [-f dedup,snapshots,dirs,checksums,large] [-o text|csv]\n");
+		return 1;
+	}
+
+	// the filesystem and disk print as they go; keep stdout for the results
+	fflush(stdout);
+	saved = dup(1);
+	null = open("/dev/null",O_WRONLY);
+	if(saved<0 || null<0) return 1;
+	dup2(null,1);
+	close(null);
+	out = fdopen(saved,"w");
+
+	if(!strcmp(format,"csv")) {
+		fprintf(out,"blocks,test,param,ops,errors,seconds,ops_per_sec,mb_per_sec,p50_us,p90_us,p99_us,max_us,disk_reads,disk_writes\n");
+	} else {
+		fprintf(out,"seed %llu, features %#x, mount repeated %d times, latencies in microseconds\n\n",(unsigned long long)seed,features,reps);
+		fprintf(out,"%7s %-12s %-14s %7s %4s %12s %9s %9s %9s %9s %9s %9s %9s\n",
+			"blocks","test","param","ops","err","ops/s","MB/s","p50","p90","p99","max","reads","writes");
+	}
+
+	for(size=strtok(sizes,",");size;size=strtok(0,",")) {
+		nblocks = atoi(size);
+		if(nblocks<20) {
+			fprintf(stderr,"skipping %d blocks: images need at least 20 blocks\n",nblocks);
+			continue;
+		}
+
+		bench_mount(nblocks);
+		bench_create_delete(nblocks);
+		bench_io(nblocks);
+		bench_files(nblocks,"small-files",2048,1000);
+		bench_files(nblocks,"large-files",1024*1024,16);
+		image_remove(nblocks);
+	}
+
+	fclose(out);
+	return 0;
+}
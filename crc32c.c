@@ -0,0 +1,200 @@
+
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_KERNEL 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78
+
+/*
+The hardware kernel runs three independent crc32 streams over LANE byte
+lanes, since one stream waits on the latency of each instruction, then
+folds them together with the shift tables below.
+*/
+
+#define LANE 1344
+
+static uint32_t table[8][256];
+static uint32_t shift1[4][256];
+static uint32_t shift2[4][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static uint32_t (*kernel)( uint32_t, const void *, size_t ) = 0;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+/*
+Fill in the tables that advance a raw crc register over n zero bytes.
+The map is linear, so it is built from the images of the 32 single bits.
+*/
+
+static void shift_init( uint32_t shift[4][256], int n )
+{
+	uint32_t bit[32];
+	int i, j, k;
+
+	for(i=0;i<32;i++) {
+		uint32_t crc = 1u<<i;
+		for(j=0;j<n;j++) {
+			crc = (crc>>8) ^ table[0][crc&0xff];
+		}
+		bit[i] = crc;
+	}
+
+	for(k=0;k<4;k++) {
+		for(i=0;i<256;i++) {
+			uint32_t crc = 0;
+			for(j=0;j<8;j++) {
+				if(i&(1<<j)) crc ^= bit[k*8+j];
+			}
+			shift[k][i] = crc;
+		}
+	}
+}
+
+static uint32_t shift_apply( uint32_t shift[4][256], uint32_t crc )
+{
+	return shift[0][crc&0xff] ^ shift[1][(crc>>8)&0xff] ^ shift[2][(crc>>16)&0xff] ^ shift[3][crc>>24];
+}
+
+static void table_init()
+{
+	int i, j;
+
+	for(i=0;i<256;i++) {
+		uint32_t crc = i;
+		for(j=0;j<8;j++) {
+			crc = (crc>>1) ^ (CRC32C_POLY & -(crc&1));
+		}
+		table[0][i] = crc;
+	}
+
+	for(i=0;i<256;i++) {
+		for(j=1;j<8;j++) {
+			table[j][i] = (table[j-1][i]>>8) ^ table[0][table[j-1][i]&0xff];
+		}
+	}
+
+	shift_init(shift1,LANE);
+	shift_init(shift2,2*LANE);
+}
+
+/*
+Slicing-by-8: eight table lookups per 8 bytes instead of one per byte.
+*/
+
+uint32_t crc32c_sw( uint32_t crc, const void *data, size_t length )
+{
+	const unsigned char *p = data;
+
+	pthread_once(&table_once,table_init);
+
+	crc = ~crc;
+
+	while(length>=8) {
+		uint32_t lo, hi;
+		memcpy(&lo,p,4);
+		memcpy(&hi,p+4,4);
+		lo ^= crc;
+		crc = table[7][lo&0xff] ^ table[6][(lo>>8)&0xff] ^ table[5][(lo>>16)&0xff] ^ table[4][lo>>24]
+		    ^ table[3][hi&0xff] ^ table[2][(hi>>8)&0xff] ^ table[1][(hi>>16)&0xff] ^ table[0][hi>>24];
+		p += 8;
+		length -= 8;
+	}
+
+	while(length--) {
+		crc = (crc>>8) ^ table[0][(crc^*p++)&0xff];
+	}
+
+	return ~crc;
+}
+
+#ifdef HAVE_SSE42_KERNEL
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw( uint32_t crc, const void *data, size_t length )
+{
+	const unsigned char *p = data;
+
+	pthread_once(&table_once,table_init);
+
+	crc = ~crc;
+
+#ifdef __x86_64__
+	while(length>=3*LANE) {
+		uint64_t a = crc, b = 0, c = 0;
+		size_t i;
+		for(i=0;i<LANE;i+=8) {
+			uint64_t wa, wb, wc;
+			memcpy(&wa,p+i,8);
+			memcpy(&wb,p+LANE+i,8);
+			memcpy(&wc,p+2*LANE+i,8);
+			a = _mm_crc32_u64(a,wa);
+			b = _mm_crc32_u64(b,wb);
+			c = _mm_crc32_u64(c,wc);
+		}
+		crc = shift_apply(shift2,(uint32_t)a) ^ shift_apply(shift1,(uint32_t)b) ^ (uint32_t)c;
+		p += 3*LANE;
+		length -= 3*LANE;
+	}
+
+	uint64_t crc64 = crc;
+	while(length>=8) {
+		uint64_t word;
+		memcpy(&word,p,8);
+		crc64 = _mm_crc32_u64(crc64,word);
+		p += 8;
+		length -= 8;
+	}
+	crc = (uint32_t)crc64;
+#endif
+
+	while(length>=4) {
+		uint32_t word;
+		memcpy(&word,p,4);
+		crc = _mm_crc32_u32(crc,word);
+		p += 4;
+		length -= 4;
+	}
+
+	while(length--) {
+		crc = _mm_crc32_u8(crc,*p++);
+	}
+
+	return ~crc;
+}
+
+int crc32c_hw_available()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+uint32_t crc32c_hw( uint32_t crc, const void *data, size_t length )
+{
+	return crc32c_sw(crc,data,length);
+}
+
+int crc32c_hw_available()
+{
+	return 0;
+}
+
+#endif
+
+static void kernel_init()
+{
+	kernel = crc32c_hw_available() ? crc32c_hw : crc32c_sw;
+}
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length )
+{
+	pthread_once(&kernel_once,kernel_init);
+	return kernel(crc,data,length);
+}
@@ -0,0 +1,18 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+CRC32C (Castagnoli) checksums.  crc32c() uses the SSE4.2 crc32
+instruction when the processor has it and a table driven version
+otherwise; the choice is made once at the first call.
+*/
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length );
+uint32_t crc32c_sw( uint32_t crc, const void *data, size_t length );
+uint32_t crc32c_hw( uint32_t crc, const void *data, size_t length );
+int      crc32c_hw_available();
+
+#endif
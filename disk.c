@@ -1,48 +1,90 @@
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
 
 #include "disk.h"
 
 #define DISK_MAGIC 0xdeadbeef
 
-static FILE *diskfile;
-static int nblocks=0;
-static int nreads=0;
-static int nwrites=0;
+struct disk {
+	FILE *file;
+	int64_t nblocks;
+	int64_t nreads;
+	int64_t nwrites;
+	int64_t ndiscards;
+};
 
-int disk_init( const char *filename, int n )
+/*
+The functions without a disk argument all work on this one, which
+disk_init opens, so programs that only need a single image can ignore
+the disk objects altogether.
+*/
+
+static struct disk default_disk;
+
+static int disk_setup( struct disk *d, const char *filename, int64_t n )
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	d->file = fopen(filename,"r+");
+	if(!d->file) d->file = fopen(filename,"w+");
+	if(!d->file) return 0;
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	ftruncate(fileno(d->file),(off_t)n*DISK_BLOCK_SIZE);
 
-	nblocks = n;
-	nreads = 0;
-	nwrites = 0;
+	d->nblocks = n;
+	d->nreads = 0;
+	d->nwrites = 0;
+	d->ndiscards = 0;
 
 	return 1;
 }
 
-int disk_size()
+struct disk * disk_ctx_open( const char *filename, int64_t n )
+{
+	struct disk *d = calloc(1,sizeof(*d));
+	if(!d) return 0;
+
+	if(!disk_setup(d,filename,n)) {
+		free(d);
+		return 0;
+	}
+
+	return d;
+}
+
+int64_t disk_ctx_size( struct disk *d )
+{
+	return d->nblocks;
+}
+
+int64_t disk_ctx_reads( struct disk *d )
+{
+	return __atomic_load_n(&d->nreads,__ATOMIC_RELAXED);
+}
+
+int64_t disk_ctx_writes( struct disk *d )
+{
+	return __atomic_load_n(&d->nwrites,__ATOMIC_RELAXED);
+}
+
+int64_t disk_ctx_discards( struct disk *d )
 {
-	return nblocks;
+	return __atomic_load_n(&d->ndiscards,__ATOMIC_RELAXED);
 }
 
-static void sanity_check( int blocknum, const void *data )
+static void sanity_check( struct disk *d, int64_t blocknum, const void *data )
 {
 	if(blocknum<0) {
-		printf("ERROR: blocknum (%d) is negative!\n",blocknum);
+		printf("ERROR: blocknum (%lld) is negative!\n",(long long)blocknum);
 		abort();
 	}
 
-	if(blocknum>=nblocks) {
-		printf("ERROR: blocknum (%d) is too big!\n",blocknum);
+	if(blocknum>=d->nblocks) {
+		printf("ERROR: blocknum (%lld) is too big!\n",(long long)blocknum);
 		abort();
 	}
 
@@ -52,41 +94,233 @@ static void sanity_check( int blocknum, const void *data )
 	}
 }
 
-void disk_read( int blocknum, char *data )
-{
-	sanity_check(blocknum,data);
+/*
+Blocks are moved with pread/pwrite on the underlying descriptor rather
+than fseek+fread, so that several threads can use the disk at once
+without sharing a file position.
+*/
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+void disk_ctx_read( struct disk *d, int64_t blocknum, char *data )
+{
+	sanity_check(d,blocknum,data);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	if(pread(fileno(d->file),data,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		__atomic_add_fetch(&d->nreads,1,__ATOMIC_RELAXED);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
 }
 
-void disk_write( int blocknum, const char *data )
+void disk_ctx_write( struct disk *d, int64_t blocknum, const char *data )
 {
-	sanity_check(blocknum,data);
-
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(d,blocknum,data);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	if(pwrite(fileno(d->file),data,DISK_BLOCK_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		__atomic_add_fetch(&d->nwrites,1,__ATOMIC_RELAXED);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
 }
 
-void disk_close()
+/*
+Writes a run of consecutive blocks with a single pwrite, for callers
+that lay out many blocks at once.  Each block still counts as a write.
+*/
+
+void disk_ctx_write_blocks( struct disk *d, int64_t blocknum, int64_t count, const char *data )
 {
-	if(diskfile) {
-		printf("%d disk block reads\n",nreads);
-		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+	size_t length = (size_t)count*DISK_BLOCK_SIZE;
+	size_t done = 0;
+
+	if(count<=0) return;
+	sanity_check(d,blocknum,data);
+	sanity_check(d,blocknum+count-1,data);
+
+	while(done<length) {
+		ssize_t result = pwrite(fileno(d->file),data+done,length-done,(off_t)blocknum*DISK_BLOCK_SIZE+done);
+		if(result<0 && errno==EINTR) continue;
+		if(result<=0) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+		done += result;
 	}
+
+	__atomic_add_fetch(&d->nwrites,count,__ATOMIC_RELAXED);
+}
+
+/*
+Blocks move between the image and a regular host file inside the kernel
+with copy_file_range, so the data never comes up into user space.  Where
+the kernel or the filesystems involved can't do that, the copy falls back
+to pread and pwrite through a small buffer.  Each returns the bytes
+moved, which come up short at the end of the host file or on an error.
+*/
+
+static int64_t disk_copy( int from, int64_t from_offset, int to, int64_t to_offset, int64_t length )
+{
+	char buffer[65536];
+	int64_t done = 0;
+	int fallback = 0;
+
+	while(done<length) {
+		ssize_t result;
+
+		if(!fallback) {
+			loff_t in = from_offset+done;
+			loff_t out = to_offset+done;
+			result = copy_file_range(from,&in,to,&out,length-done,0);
+			if(result<0 && (errno==EXDEV || errno==EINVAL || errno==ENOSYS || errno==EOPNOTSUPP)) {
+				fallback = 1;
+				continue;
+			}
+		} else {
+			size_t n = length-done<(int64_t)sizeof(buffer) ? length-done : sizeof(buffer);
+			ssize_t written = 0;
+			result = pread(from,buffer,n,from_offset+done);
+			while(result>0 && written<result) {
+				ssize_t w = pwrite(to,buffer+written,result-written,to_offset+done+written);
+				if(w<0 && errno==EINTR) continue;
+				if(w<=0) {
+					result = -1;
+					break;
+				}
+				written += w;
+			}
+			if(result<0) done += written;
+		}
+
+		if(result<0 && errno==EINTR) continue;
+		if(result<0) {
+			printf("ERROR: couldn't copy blocks: %s\n",strerror(errno));
+			break;
+		}
+		if(result==0) break;
+		done += result;
+	}
+
+	return done;
 }
 
+int64_t disk_ctx_copy_in( struct disk *d, int64_t blocknum, int64_t count, int fd, int64_t offset )
+{
+	int64_t moved;
+
+	if(count<=0) return 0;
+	sanity_check(d,blocknum,d->file);
+	sanity_check(d,blocknum+count-1,d->file);
+
+	moved = disk_copy(fd,offset,fileno(d->file),blocknum*DISK_BLOCK_SIZE,count*DISK_BLOCK_SIZE);
+	__atomic_add_fetch(&d->nwrites,(moved+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE,__ATOMIC_RELAXED);
+	return moved;
+}
+
+int64_t disk_ctx_copy_out( struct disk *d, int64_t blocknum, int64_t count, int fd, int64_t offset )
+{
+	int64_t moved;
+
+	if(count<=0) return 0;
+	sanity_check(d,blocknum,d->file);
+	sanity_check(d,blocknum+count-1,d->file);
+
+	moved = disk_copy(fileno(d->file),blocknum*DISK_BLOCK_SIZE,fd,offset,count*DISK_BLOCK_SIZE);
+	__atomic_add_fetch(&d->nreads,(moved+DISK_BLOCK_SIZE-1)/DISK_BLOCK_SIZE,__ATOMIC_RELAXED);
+	return moved;
+}
+
+/*
+Discarding punches a hole over a run of blocks in the image file, so the
+host can reclaim the space.  The blocks read back as zeros afterwards.
+*/
+
+int disk_ctx_discard( struct disk *d, int64_t blocknum, int64_t count )
+{
+	sanity_check(d,blocknum,d->file);
+	sanity_check(d,blocknum+count-1,d->file);
+
+	if(fallocate(fileno(d->file),FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,(off_t)blocknum*DISK_BLOCK_SIZE,(off_t)count*DISK_BLOCK_SIZE)==0) {
+		__atomic_add_fetch(&d->ndiscards,count,__ATOMIC_RELAXED);
+		return 1;
+	} else {
+		printf("ERROR: couldn't discard blocks %lld-%lld: %s\n",(long long)blocknum,(long long)(blocknum+count-1),strerror(errno));
+		return 0;
+	}
+}
+
+void disk_ctx_close( struct disk *d )
+{
+	if(d) {
+		fclose(d->file);
+		free(d);
+	}
+}
+
+struct disk * disk_default()
+{
+	return &default_disk;
+}
+
+int disk_init( const char *filename, int64_t n )
+{
+	return disk_setup(&default_disk,filename,n);
+}
+
+int64_t disk_size()
+{
+	return disk_ctx_size(&default_disk);
+}
+
+int64_t disk_reads()
+{
+	return disk_ctx_reads(&default_disk);
+}
+
+int64_t disk_writes()
+{
+	return disk_ctx_writes(&default_disk);
+}
+
+void disk_read( int64_t blocknum, char *data )
+{
+	disk_ctx_read(&default_disk,blocknum,data);
+}
+
+void disk_write( int64_t blocknum, const char *data )
+{
+	disk_ctx_write(&default_disk,blocknum,data);
+}
+
+void disk_write_blocks( int64_t blocknum, int64_t count, const char *data )
+{
+	disk_ctx_write_blocks(&default_disk,blocknum,count,data);
+}
+
+int64_t disk_copy_in( int64_t blocknum, int64_t count, int fd, int64_t offset )
+{
+	return disk_ctx_copy_in(&default_disk,blocknum,count,fd,offset);
+}
+
+int64_t disk_copy_out( int64_t blocknum, int64_t count, int fd, int64_t offset )
+{
+	return disk_ctx_copy_out(&default_disk,blocknum,count,fd,offset);
+}
+
+int disk_discard( int64_t blocknum, int64_t count )
+{
+	return disk_ctx_discard(&default_disk,blocknum,count);
+}
+
+void disk_close()
+{
+	struct disk *d = &default_disk;
+
+	if(d->file) {
+		printf("%lld disk block reads\n",(long long)d->nreads);
+		printf("%lld disk block writes\n",(long long)d->nwrites);
+		if(d->ndiscards) printf("%lld disk block discards\n",(long long)d->ndiscards);
+		fclose(d->file);
+		d->file = 0;
+	}
+}
@@ -1,13 +1,44 @@
 #ifndef DISK_H
 #define DISK_H
 
+#include <stdint.h>
+
 #define DISK_BLOCK_SIZE 4096
 
-int  disk_init( const char *filename, int nblocks );
-int  disk_size();
-void disk_read( int blocknum, char *data );
-void disk_write( int blocknum, const char *data );
-void disk_close();
+/*
+Each struct disk is one open image with its own size and counters.
+The plain disk_* functions act on a single default disk, opened by
+disk_init, and disk_default returns it for use with the rest.
+*/
+
+struct disk;
+
+struct disk * disk_ctx_open( const char *filename, int64_t nblocks );
+int64_t disk_ctx_size( struct disk *d );
+int64_t disk_ctx_reads( struct disk *d );
+int64_t disk_ctx_writes( struct disk *d );
+int64_t disk_ctx_discards( struct disk *d );
+void    disk_ctx_read( struct disk *d, int64_t blocknum, char *data );
+void    disk_ctx_write( struct disk *d, int64_t blocknum, const char *data );
+void    disk_ctx_write_blocks( struct disk *d, int64_t blocknum, int64_t count, const char *data );
+int64_t disk_ctx_copy_in( struct disk *d, int64_t blocknum, int64_t count, int fd, int64_t offset );
+int64_t disk_ctx_copy_out( struct disk *d, int64_t blocknum, int64_t count, int fd, int64_t offset );
+int     disk_ctx_discard( struct disk *d, int64_t blocknum, int64_t count );
+void    disk_ctx_close( struct disk *d );
+
+struct disk * disk_default();
+
+int     disk_init( const char *filename, int64_t nblocks );
+int64_t disk_size();
+int64_t disk_reads();
+int64_t disk_writes();
+void    disk_read( int64_t blocknum, char *data );
+void    disk_write( int64_t blocknum, const char *data );
+void    disk_write_blocks( int64_t blocknum, int64_t count, const char *data );
+int64_t disk_copy_in( int64_t blocknum, int64_t count, int fd, int64_t offset );
+int64_t disk_copy_out( int64_t blocknum, int64_t count, int fd, int64_t offset );
+int     disk_discard( int64_t blocknum, int64_t count );
+void    disk_close();
 
 
 #endif
@@ -1,22 +1,50 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "fs.h"
 #include "disk.h"
+#include "crc32c.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #define DISK_BLOCK_SIZE    4096
 #define FS_MAGIC           0xf0f03410
 #define INODES_PER_BLOCK   128
+#define MAX_INODE_BLOCKS   (INT32_MAX / INODES_PER_BLOCK)
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
-
-int is_mounted = 0;
-int free_block_bitmap[DISK_BLOCK_SIZE] = {0};
+#define INFOS_PER_BLOCK    256
+#define INDIRECT_LEVELS    3
+#define LARGE_DIRECT       2
+#define INODE_LOCKS        1024
+#define INODE_BLOCK_LOCKS  256
+#define ALLOC_SHARDS       16
+
+// free_block_bitmap values besides 0 (free) and 1 (in use)
+#define BLOCK_DISCARDING   2
+
+#define INODE_FILE         1
+#define INODE_DIR          2
+#define INODE_TYPE         0xff
+#define INODE_NAMED        0x100
+#define ROOT_INUMBER       1
+
+// directory files: block 0 is a header, blocks 1..DIR_TABLE_BLOCKS hold the
+// extendible hash table (only the part in use is ever written) and buckets follow
+#define DIR_MAGIC          0xd1d1d1d1
+#define DIR_TABLE_BLOCKS   64
+#define DIR_MAX_DEPTH      16
+#define DIR_FIRST_BUCKET   (1 + DIR_TABLE_BLOCKS)
 
 
 struct fs_superblock {
@@ -24,25 +52,228 @@ struct fs_superblock {
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int features;
+	int ninfoblocks;
+	int snaptable;
 };
 
+// an inode in memory; indirect[0] is a single indirect block, [1] and [2]
+// the roots of double and triple indirect trees, which only large
+// filesystems use, as they use only the first LARGE_DIRECT direct pointers.
+// named is set while a directory entry names the inode, and is kept on
+// disk as the INODE_NAMED bit of isvalid
 struct fs_inode {
+	int isvalid;
+	int named;
+	int64_t size;
+	int direct[POINTERS_PER_INODE];
+	int indirect[INDIRECT_LEVELS];
+};
+
+// the inode as stored by the original format
+struct fs_disk_inode {
 	int isvalid;
 	int size;
 	int direct[POINTERS_PER_INODE];
 	int indirect;
 };
 
+// the inode as stored by large filesystems, the same 32 bytes with
+// isvalid in the same place, so either layout can be tested for a free slot
+struct fs_disk_inode_large {
+	int isvalid;
+	int direct[LARGE_DIRECT];
+	int indirect[INDIRECT_LEVELS];
+	int64_t size;
+};
+
+// one entry per disk block, stored in the info table right after the inode table
+struct fs_blockinfo {
+	uint32_t refs;
+	uint32_t crc;
+	uint64_t hash;
+};
+
+// a frozen copy of the inode table; mapblock starts a chain of blocks listing
+// the copied inode blocks, with the last pointer of each linking the next
+struct fs_snapshot {
+	int isvalid;
+	int id;
+	int mapblock;
+	int nfiles;
+	int64_t created;
+};
+
+#define SNAPSHOTS_PER_BLOCK (DISK_BLOCK_SIZE / sizeof(struct fs_snapshot))
+#define MAP_ENTRIES_PER_BLOCK (POINTERS_PER_BLOCK - 1)
+
+struct fs_dirent {
+	int inumber;
+	char name[FS_NAME_MAX + 1];
+};
+
+struct fs_dirheader {
+	int magic;
+	int depth;
+	int nbuckets;
+	int nentries;
+};
+
+#define DIRENTS_PER_BUCKET ((DISK_BLOCK_SIZE - 2 * sizeof(int)) / sizeof(struct fs_dirent))
+
+struct fs_dirbucket {
+	int depth;
+	int count;
+	struct fs_dirent entry[DIRENTS_PER_BUCKET];
+};
+
 union fs_block {
 	struct fs_superblock super;
-	struct fs_inode inode[INODES_PER_BLOCK];
+	struct fs_disk_inode inode[INODES_PER_BLOCK];
+	struct fs_disk_inode_large inode_large[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	struct fs_blockinfo info[INFOS_PER_BLOCK];
+	struct fs_snapshot snapshot[SNAPSHOTS_PER_BLOCK];
+	struct fs_dirheader dirheader;
+	struct fs_dirbucket dirbucket;
 	char data[DISK_BLOCK_SIZE];
 };
 
-void inode_load( int inumber, struct fs_inode *inode ) {}
-void inode_save( int inumber, struct fs_inode *inode ) {}
+// the blocks of a directory the image builder is putting together in memory
+struct fs_stage {
+	union fs_block *blocks;
+	unsigned char *present;
+	int nblocks;
+	int capacity;
+};
+
+// one cached block of an indirect tree
+struct fs_map {
+	int blocknum;
+	int dirty;
+	union fs_block block;
+};
+
+// an inode being worked on, with the indirect blocks on the path to the
+// last block it touched cached, one per tree and level
+struct fs_file {
+	int inumber;
+	struct fs_inode inode;
+	struct fs_map map[INDIRECT_LEVELS][INDIRECT_LEVELS];
+	pthread_mutex_t *map_lock;
+	int inode_dirty;
+	int writeback;
+	struct fs_stage *stage;
+};
+
+// an inode held open by one or more handles; its fs_file, indirect block
+// included, stays in memory and is the copy every operation on the inode
+// uses, with the inode and indirect block written back at close
+struct open_inode {
+	int inumber;
+	int refs;
+	int dead;
+	pthread_mutex_t map_lock;
+	struct fs_file file;
+	struct open_inode *next;
+};
+
+struct fs_handle {
+	struct fs *fs;
+	struct open_inode *open;
+	int64_t position;
+};
+
+#define OPEN_BUCKETS 256
+
+struct dedup_slot {
+	uint64_t hash;
+	int blocknum;
+};
+
+// one slice of the free block bitmap, together with the block info entries
+// and info table dirty flags that cover the same blocks
+struct alloc_shard {
+	pthread_mutex_t lock;
+	int start;
+	int end;
+	int next;
+	int full;	// set when a scan found nothing, cleared by a free
+};
+
+// one filesystem instance: everything below lives on the disk it was
+// created on, so any number of them can be mounted side by side
+struct fs {
+	struct disk *disk;
+	int is_mounted;
+	unsigned char *free_block_bitmap;
+
+	struct fs_superblock super;
+	int data_start;
+
+	struct fs_blockinfo *block_info;
+	unsigned char *info_dirty;
+
+	struct dedup_slot *dedup_index;
+	size_t dedup_mask;
+
+	struct alloc_shard *alloc_shards;
+	int nshards;
+	int shard_blocks;
+
+	// fs_lock is held shared by every file operation and exclusively by format,
+	// mount and snapshot create/delete; inodes and inode blocks hash onto stripes
+	pthread_rwlock_t fs_lock;
+	pthread_rwlock_t inode_locks[INODE_LOCKS];
+	pthread_mutex_t inode_block_locks[INODE_BLOCK_LOCKS];
+	pthread_mutex_t dedup_lock;
+
+	// blocks freed with discard on wait here, still unallocatable, until the
+	// end of the operation punches them out of the image in coalesced runs
+	int discard_enabled;
+	pthread_mutex_t discard_lock;
+	int *discard_pending;
+	int discard_count;
+	int discard_capacity;
+
+	// open inodes by inumber; entries are added and removed with the inode lock
+	// held for writing, so holding it either way keeps a lookup valid
+	struct open_inode *open_table[OPEN_BUCKETS];
+	pthread_mutex_t open_lock;
+};
+
+static void locks_init(struct fs *fs) {
+	pthread_rwlock_init(&fs->fs_lock, 0);
+	pthread_mutex_init(&fs->dedup_lock, 0);
+	pthread_mutex_init(&fs->discard_lock, 0);
+	pthread_mutex_init(&fs->open_lock, 0);
+	for (int i = 0; i < INODE_LOCKS; i++) {
+		pthread_rwlock_init(&fs->inode_locks[i], 0);
+	}
+	for (int i = 0; i < INODE_BLOCK_LOCKS; i++) {
+		pthread_mutex_init(&fs->inode_block_locks[i], 0);
+	}
+}
+
+static void fs_lock_shared(struct fs *fs) {
+	pthread_rwlock_rdlock(&fs->fs_lock);
+}
+
+static void fs_lock_exclusive(struct fs *fs) {
+	pthread_rwlock_wrlock(&fs->fs_lock);
+}
+
+static void fs_unlock(struct fs *fs) {
+	pthread_rwlock_unlock(&fs->fs_lock);
+}
+
+static pthread_rwlock_t *inode_lock(struct fs *fs, int inumber) {
+	return &fs->inode_locks[(unsigned)inumber % INODE_LOCKS];
+}
 
+static pthread_mutex_t *inode_block_lock(struct fs *fs, int block_num) {
+	return &fs->inode_block_locks[(unsigned)block_num % INODE_BLOCK_LOCKS];
+}
 
 int verify_magic_num(int magic) {
 	return (magic == FS_MAGIC);
@@ -54,7 +285,7 @@ int get_block_num(int inumber) {
 
 void print_blocks(int a[], int sz){
 	for (int i = 0; i < sz; i++) {
-		if(a[i] == 0){ 
+		if(a[i] == 0){
 			continue;
 		}
 		printf("%d ",a[i]);
@@ -62,540 +293,3571 @@ void print_blocks(int a[], int sz){
 	printf("\n");
 }
 
-int first_free_block() {
-    int i;
-    for (i = 2; i < DISK_BLOCK_SIZE; i++) {
-        if (free_block_bitmap[i] == 0) {
-            return i;
-        }
-    }
-    return -1;
+static int block_read(struct fs *fs, int blocknum, char *data);
+static void block_write(struct fs *fs, int blocknum, const char *data);
+
+static int large_enabled(struct fs *fs) {
+	return fs->super.features & FS_FEATURE_LARGE;
+}
+
+// direct pointers and indirect tree levels an inode of this filesystem has
+static int direct_count(struct fs *fs) {
+	return large_enabled(fs) ? LARGE_DIRECT : POINTERS_PER_INODE;
 }
 
-int getNextBlock() {
+static int indirect_count(struct fs *fs) {
+	return large_enabled(fs) ? INDIRECT_LEVELS : 1;
+}
 
-    union fs_block block;
+// blocks addressed by a tree with this many levels of indirect blocks
+static int64_t tree_span(int levels) {
+	int64_t span = 1;
+	while (levels-- > 0) span *= POINTERS_PER_BLOCK;
+	return span;
+}
 
-    disk_read(0, block.data); //read superblock
+static int64_t file_max_blocks(struct fs *fs) {
+	int64_t blocks = direct_count(fs);
+	for (int level = 1; level <= indirect_count(fs); level++) {
+		blocks += tree_span(level);
+	}
+	return blocks;
+}
 
+// convert between an inode in an inode table block and its in-memory form
+static void inode_decode_as(int large, union fs_block *block, int index, struct fs_inode *inode) {
+	memset(inode, 0, sizeof(*inode));
+	if (large) {
+		struct fs_disk_inode_large *disk = &block->inode_large[index];
+		inode->isvalid = disk->isvalid & INODE_TYPE;
+		inode->named = (disk->isvalid & INODE_NAMED) != 0;
+		inode->size = disk->size;
+		memcpy(inode->direct, disk->direct, sizeof(disk->direct));
+		memcpy(inode->indirect, disk->indirect, sizeof(disk->indirect));
+	} else {
+		struct fs_disk_inode *disk = &block->inode[index];
+		inode->isvalid = disk->isvalid & INODE_TYPE;
+		inode->named = (disk->isvalid & INODE_NAMED) != 0;
+		inode->size = disk->size;
+		memcpy(inode->direct, disk->direct, sizeof(disk->direct));
+		inode->indirect[0] = disk->indirect;
+	}
+}
 
+static void inode_decode(struct fs *fs, union fs_block *block, int index, struct fs_inode *inode) {
+	inode_decode_as(large_enabled(fs), block, index, inode);
+}
 
-    int i;
+static void inode_encode(struct fs *fs, union fs_block *block, int index, const struct fs_inode *inode) {
+	if (large_enabled(fs)) {
+		struct fs_disk_inode_large *disk = &block->inode_large[index];
+		disk->isvalid = inode->isvalid | (inode->isvalid && inode->named ? INODE_NAMED : 0);
+		disk->size = inode->size;
+		memcpy(disk->direct, inode->direct, sizeof(disk->direct));
+		memcpy(disk->indirect, inode->indirect, sizeof(disk->indirect));
+	} else {
+		struct fs_disk_inode *disk = &block->inode[index];
+		disk->isvalid = inode->isvalid | (inode->isvalid && inode->named ? INODE_NAMED : 0);
+		disk->size = inode->size;
+		memcpy(disk->direct, inode->direct, sizeof(disk->direct));
+		disk->indirect = inode->indirect[0];
+	}
+}
 
-    for (i = block.super.ninodeblocks + 1; i < DISK_BLOCK_SIZE; i++) {
+// an inode whose block fails its checksum comes back zeroed, as if free
+int inode_load( struct fs *fs, int inumber, struct fs_inode *inode ) {
+	union fs_block block;
+	int block_num = get_block_num(inumber);
+	pthread_mutex_lock(inode_block_lock(fs, block_num));
+	int ok = block_read(fs, block_num, block.data);
+	pthread_mutex_unlock(inode_block_lock(fs, block_num));
+	if (!ok) {
+		memset(inode, 0, sizeof(*inode));
+		return 0;
+	}
+	inode_decode(fs, &block, inumber % INODES_PER_BLOCK, inode);
+	return 1;
+}
 
-        if (free_block_bitmap[i] == 0) {
+// other inodes share the block, so the read-modify-write must not interleave;
+// a block that fails its checksum is left alone rather than given a fresh one
+int inode_save( struct fs *fs, int inumber, struct fs_inode *inode ) {
+	union fs_block block;
+	int block_num = get_block_num(inumber);
+	pthread_mutex_lock(inode_block_lock(fs, block_num));
+	int ok = block_read(fs, block_num, block.data);
+	if (ok) {
+		inode_encode(fs, &block, inumber % INODES_PER_BLOCK, inode);
+		block_write(fs, block_num, block.data);
+	}
+	pthread_mutex_unlock(inode_block_lock(fs, block_num));
+	return ok;
+}
 
-            memset(&free_block_bitmap[i], 0, sizeof(free_block_bitmap[0]));
+static int inumber_in_range(struct fs *fs, int inumber) {
+	return inumber > 0 && inumber < fs->super.ninodes;
+}
 
-            return i;
+// 64-bit content hash over a whole block, four independent lanes so the
+// multiplies pipeline; never returns 0 since 0 marks "not indexed"
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
 
-        }
+static uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
 
-    }
+static uint64_t hash_round(uint64_t acc, uint64_t lane) {
+	acc += lane * HASH_PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * HASH_PRIME1;
+}
 
+static uint64_t block_hash(const char *data) {
+	uint64_t v1 = HASH_PRIME1 + HASH_PRIME2;
+	uint64_t v2 = HASH_PRIME2;
+	uint64_t v3 = 0;
+	uint64_t v4 = -HASH_PRIME1;
+	uint64_t lane[4];
+
+	for (int i = 0; i < DISK_BLOCK_SIZE; i += sizeof(lane)) {
+		memcpy(lane, data + i, sizeof(lane));
+		v1 = hash_round(v1, lane[0]);
+		v2 = hash_round(v2, lane[1]);
+		v3 = hash_round(v3, lane[2]);
+		v4 = hash_round(v4, lane[3]);
+	}
 
+	uint64_t h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	return h ? h : 1;
+}
 
-    printf("Error: no more room for blocks\n");
+// dedup index: open addressing keyed by content hash, rebuilt from the info table at mount
 
-    return -1;
+static size_t dedup_slot_of(struct fs *fs, uint64_t hash) {
+	return (size_t)(hash ^ (hash >> 29)) & fs->dedup_mask;
+}
 
+static int dedup_lookup(struct fs *fs, uint64_t hash) {
+	for (size_t i = dedup_slot_of(fs, hash); fs->dedup_index[i].blocknum; i = (i + 1) & fs->dedup_mask) {
+		if (fs->dedup_index[i].hash == hash) {
+			return fs->dedup_index[i].blocknum;
+		}
+	}
+	return 0;
 }
 
-int fs_format() {
-	union fs_block iblock;
-	int  ninodeblocks;
-	union fs_block block;
-	disk_read(0, block.data); //read in superblock
-	
-	if (is_mounted) { //check if the filesystem is already mounted
-		printf("Format failed: the filesystem is already mounted\n");
-	 	return 0;
+static void dedup_insert(struct fs *fs, uint64_t hash, int blocknum) {
+	size_t i;
+	for (i = dedup_slot_of(fs, hash); fs->dedup_index[i].blocknum; i = (i + 1) & fs->dedup_mask) {
+		if (fs->dedup_index[i].hash == hash) {
+			return; // keep the block already indexed for this content
+		}
 	}
+	fs->dedup_index[i].hash = hash;
+	fs->dedup_index[i].blocknum = blocknum;
+}
 
-    //create superblock
-    ninodeblocks = ceil(.1 * (double)disk_size()); // set aside 10% of blocks for inodes
-	block.super.ninodeblocks = ninodeblocks;
-	block.super.ninodes = INODES_PER_BLOCK * ninodeblocks;
-	block.super.magic = FS_MAGIC;
-	block.super.nblocks = disk_size();
-	
+static void dedup_remove(struct fs *fs, uint64_t hash, int blocknum) {
+	size_t i = dedup_slot_of(fs, hash);
+	while (fs->dedup_index[i].blocknum && !(fs->dedup_index[i].hash == hash && fs->dedup_index[i].blocknum == blocknum)) {
+		i = (i + 1) & fs->dedup_mask;
+	}
+	if (!fs->dedup_index[i].blocknum) {
+		return;
+	}
 
-	// write changes to disk
-	disk_write(0, block.data);
+	// backward-shift the rest of the cluster so lookups never stop early
+	size_t j = i;
+	while (1) {
+		fs->dedup_index[i].blocknum = 0;
+		size_t home;
+		do {
+			j = (j + 1) & fs->dedup_mask;
+			if (!fs->dedup_index[j].blocknum) {
+				return;
+			}
+			home = dedup_slot_of(fs, fs->dedup_index[j].hash);
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		fs->dedup_index[i] = fs->dedup_index[j];
+		i = j;
+	}
+}
 
-	// clear inode table
-	for (int i = 1; i <= block.super.ninodeblocks; i++) {
-		disk_read(i, iblock.data);
+// block info table and allocator
 
-		for (int k = 0; k < INODES_PER_BLOCK; k++) {
-			iblock.inode[k].isvalid = 0;
+static struct alloc_shard *shard_of(struct fs *fs, int blocknum) {
+	return &fs->alloc_shards[blocknum / fs->shard_blocks];
+}
+
+// callers hold the shard lock of blocknum
+static void info_mark(struct fs *fs, int blocknum) {
+	fs->info_dirty[blocknum / INFOS_PER_BLOCK] = 1;
+}
+
+static int discard_queue(struct fs *fs, int blocknum) {
+	pthread_mutex_lock(&fs->discard_lock);
+	if (fs->discard_count == fs->discard_capacity) {
+		int capacity = fs->discard_capacity ? fs->discard_capacity * 2 : 256;
+		int *pending = realloc(fs->discard_pending, capacity * sizeof(int));
+		if (!pending) {
+			pthread_mutex_unlock(&fs->discard_lock);
+			return 0;
 		}
-		disk_write(i, iblock.data);
+		fs->discard_pending = pending;
+		fs->discard_capacity = capacity;
 	}
-
+	fs->discard_pending[fs->discard_count++] = blocknum;
+	pthread_mutex_unlock(&fs->discard_lock);
 	return 1;
 }
 
-void fs_debug() {
-	int inum;
-	union fs_block indirect_block;
-	union fs_block block;
-	disk_read(0,block.data); //read in super block
-	printf("superblock:\n");
-	if (verify_magic_num(block.super.magic))
-		printf("    magic number is valid\n");
-	else {
-		printf("    magic number is not valid\n");
-		return;
+// called with the shard lock of blocknum held
+static void block_free(struct fs *fs, int blocknum) {
+	if (fs->discard_enabled && discard_queue(fs, blocknum)) {
+		fs->free_block_bitmap[blocknum] = BLOCK_DISCARDING;
+	} else {
+		fs->free_block_bitmap[blocknum] = 0;
+		shard_of(fs, blocknum)->full = 0;
 	}
-	printf("    %d blocks\n",block.super.nblocks);
-	printf("    %d inode blocks\n",block.super.ninodeblocks);
-	printf("    %d inodes\n",block.super.ninodes);
-	
-	for (int i = 1; i <= block.super.ninodeblocks; i++) {  //traverse inode blocks
-	
-		disk_read(i, block.data); //read in inode block
+}
 
+static int compare_blocks(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
 
-		for (int z = 1; z < INODES_PER_BLOCK; z++) {//scan through inodes
-			
-			if (block.inode[z].isvalid) { //verify inode is valid
-			    inum = (i- 1)*INODES_PER_BLOCK + z;
-				printf("inode %d:\n", inum);
-				printf("    size: %d bytes\n", block.inode[z].size);
+static void discard_flush(struct fs *fs) {
+	pthread_mutex_lock(&fs->discard_lock);
+	int *pending = fs->discard_pending;
+	int count = fs->discard_count;
+	fs->discard_pending = 0;
+	fs->discard_count = 0;
+	fs->discard_capacity = 0;
+	pthread_mutex_unlock(&fs->discard_lock);
+
+	if (count) {
+		qsort(pending, count, sizeof(int), compare_blocks);
+		for (int i = 0, j; i < count; i = j) {
+			for (j = i + 1; j < count && pending[j] == pending[j - 1] + 1; j++);
+			if (fs->discard_enabled && !disk_ctx_discard(fs->disk, pending[i], j - i)) {
+				printf("Error: discard not supported, turning it off\n");
+				fs->discard_enabled = 0;
+			}
+		}
 
-				
-				if (block.inode[z].size > 0) { //go through direct pointers
-					printf("    direct blocks: ");
-					print_blocks(block.inode[z].direct, POINTERS_PER_INODE);
-				}
+		// only now may the allocator hand these blocks out again
+		for (int i = 0; i < count; i++) {
+			struct alloc_shard *shard = shard_of(fs, pending[i]);
+			pthread_mutex_lock(&shard->lock);
+			fs->free_block_bitmap[pending[i]] = 0;
+			shard->full = 0;
+			pthread_mutex_unlock(&shard->lock);
+		}
+	}
+	free(pending);
+}
 
-			
-				if (block.inode[z].indirect != 0) { //go through indirect pointers
-					printf("    indirect block: %d\n", block.inode[z].indirect);
-					printf("    indirect data blocks: ");
-					disk_read(block.inode[z].indirect, indirect_block.data);
-					print_blocks(indirect_block.pointers, POINTERS_PER_BLOCK);
-				}
+// persist the allocation state, then discard whatever it freed
+static void info_flush(struct fs *fs) {
+	if (fs->block_info) {
+		for (int i = 0; i < fs->super.ninfoblocks; i++) {
+			struct alloc_shard *shard = shard_of(fs, i * INFOS_PER_BLOCK);
+			pthread_mutex_lock(&shard->lock);
+			if (fs->info_dirty[i]) {
+				disk_ctx_write(fs->disk, 1 + fs->super.ninodeblocks + i, (const char *)&fs->block_info[i * INFOS_PER_BLOCK]);
+				fs->info_dirty[i] = 0;
 			}
+			pthread_mutex_unlock(&shard->lock);
 		}
 	}
-
+	discard_flush(fs);
 }
 
-int fs_mount() {
-	union fs_block block;
+static int checksums_enabled(struct fs *fs) {
+	return fs->block_info && (fs->super.features & FS_FEATURE_CHECKSUMS);
+}
 
-	// check magic number
-	disk_read(0,block.data);
-	int valid_super_block = verify_magic_num(block.super.magic);
-	if (!valid_super_block) {
-		printf("Invalid superblock\n");
-		return 0;
+// every block except the superblock and the info table itself goes through
+// these two, which keep its checksum in the info table up to date
+static void block_write(struct fs *fs, int blocknum, const char *data) {
+	disk_ctx_write(fs->disk, blocknum, data);
+	if (checksums_enabled(fs)) {
+		uint32_t crc = crc32c(0, data, DISK_BLOCK_SIZE);
+		struct alloc_shard *shard = shard_of(fs, blocknum);
+		pthread_mutex_lock(&shard->lock);
+		fs->block_info[blocknum].crc = crc;
+		info_mark(fs, blocknum);
+		pthread_mutex_unlock(&shard->lock);
 	}
+}
 
-	// scan through all inodes and record which blocks in use
-	int i;
-	for (i = 1; i <= block.super.ninodeblocks; i++){
-		// Read in inode block
-		disk_read(i, block.data);
-
-		// Traverse inodes
-		int j;
-		for (j = 0; j < INODES_PER_BLOCK; j++) {
-			// Check if inode is valid
-			if (block.inode[j].isvalid) {
+static int block_read(struct fs *fs, int blocknum, char *data) {
+	disk_ctx_read(fs->disk, blocknum, data);
+	if (checksums_enabled(fs)) {
+		uint32_t crc = crc32c(0, data, DISK_BLOCK_SIZE);
+		struct alloc_shard *shard = shard_of(fs, blocknum);
+		pthread_mutex_lock(&shard->lock);
+		uint32_t expected = fs->block_info[blocknum].crc;
+		pthread_mutex_unlock(&shard->lock);
+		if (crc != expected) {
+			printf("Error: checksum mismatch in block %d\n", blocknum);
+			return 0;
+		}
+	}
+	return 1;
+}
 
-				// check direct blocks
-				int k;
-				for (k = 0; k < POINTERS_PER_INODE; k++) {
-					int direct_block_num = block.inode[j].direct[k];
-					if (direct_block_num != 0) {
-						//printf("block num: %d\n", direct_block_num);
-						free_block_bitmap[direct_block_num] = 1;
-					}
-				}
-				// check indirect block
-				if (block.inode[j].indirect != 0) {
-					union fs_block indirect_block;
-					disk_read(block.inode[j].indirect, indirect_block.data);
-					for (k = 0; k < POINTERS_PER_BLOCK; k++) {
-						int indirect_block_num = indirect_block.pointers[k];
-						//printf("indirect block: %d\n", indirect_block_num);
-						free_block_bitmap[indirect_block_num] = 1;
-					}
+// the hint picks the shard to start in, so threads working on different
+// inodes mostly allocate from different shards
+static int block_alloc(struct fs *fs, int hint) {
+	for (int n = 0; n < fs->nshards; n++) {
+		struct alloc_shard *shard = &fs->alloc_shards[(hint + n) % fs->nshards];
+		int span = shard->end - shard->start;
+
+		pthread_mutex_lock(&shard->lock);
+		for (int k = 0; k < span && !shard->full; k++) {
+			int i = shard->next + k;
+			if (i >= shard->end) i -= span;
+			if (fs->free_block_bitmap[i] == 0) {
+				fs->free_block_bitmap[i] = 1;
+				if (fs->block_info) {
+					fs->block_info[i].refs = 1;
+					fs->block_info[i].hash = 0;
+					info_mark(fs, i);
 				}
+				shard->next = (i + 1 < shard->end) ? i + 1 : shard->start;
+				pthread_mutex_unlock(&shard->lock);
+				return i;
 			}
 		}
+		shard->full = 1;
+		pthread_mutex_unlock(&shard->lock);
 	}
-	
-	// prepare fs for use
-	is_mounted = 1;
-	return 1;
 
+	printf("Error: no more room for blocks\n");
+	return 0;
 }
 
-//how do we know where to store new inode?
-//how do we access superblock to get number of inodes so we can do block.inode[ninodes] to set inode
-//inodes should start as valid correct
-//do we need to traverse inodes to know where to create?
-
-/*
-struct fs_inode {
-    int isvalid;
-    int size;
-    int direct[POINTERS_PER_INODE];
-    int indirect;
-};
- */
-//iterates through blocks to find first free inode and sets it to valid, returns 0 if fails
-
-//POSSIBLE SUGGESTION: have inode numbers start at 1, but the inodes themselves are placed starting at position 0
-
-int fs_create() {
-    union fs_block block;
-    union fs_block iblock;
-    
-    disk_read(0, block.data); //read in superblock
-    
-    
-    
-    int found = 0;
-    int inm = 0;
-    // check for first free inode
-    for (int i = 1; i <= block.super.ninodeblocks; i++) {
-        disk_read(i, iblock.data);
-
-        for (int k = 0; k < INODES_PER_BLOCK; k++) {
-            
-            int temp_inm = ((i-1)*INODES_PER_BLOCK)+k;
-            
-            //if inode is free, set it to be valid and zero all other variables
-            if(iblock.inode[k].isvalid == 0 && temp_inm != 0)
-            {
-                iblock.inode[k].isvalid = 1;
-                iblock.inode[k].size = 0;
-                iblock.inode[k].indirect = 0;
-                for (int j = 0; j < POINTERS_PER_INODE; j++) {
-                    iblock.inode[k].direct[j] = 0;
-                }
+static uint32_t block_refs(struct fs *fs, int blocknum) {
+	if (!fs->block_info) {
+		return 1;
+	}
+	struct alloc_shard *shard = shard_of(fs, blocknum);
+	pthread_mutex_lock(&shard->lock);
+	uint32_t refs = fs->block_info[blocknum].refs;
+	pthread_mutex_unlock(&shard->lock);
+	return refs;
+}
 
-                //getting inumber based on array location (k) and block location (i)
-                inm = temp_inm;
-                found = 1;
-            }
-            
-            //write changes if new inode is created, increment number of inodes and return inumber
-            if(found != 0)
-            {
-                disk_write(i, iblock.data);
-                
-                return inm;
-                
-            }
-            
-            
-        }
-        
-        
-    }
-    
-    
-	return 0;
+static void block_ref(struct fs *fs, int blocknum) {
+	struct alloc_shard *shard = shard_of(fs, blocknum);
+	pthread_mutex_lock(&shard->lock);
+	fs->block_info[blocknum].refs++;
+	info_mark(fs, blocknum);
+	pthread_mutex_unlock(&shard->lock);
 }
 
-//sets specified inode to invalid
-//TODO ADD BAD INPUT CHECKING
-int fs_delete( int inumber ) {
-    
-    // read block from inumber
-    union fs_block block;
-    int block_num = get_block_num(inumber);
-    disk_read(block_num, block.data);
-    
-    //translate inumber to inode (get array location)
-    int inode_number = inumber - ((block_num-1)*INODES_PER_BLOCK);
-
-    //mark as invalid and zero
-    if (block.inode[inode_number].isvalid) {
-        block.inode[inode_number].isvalid = 0;
-        block.inode[inode_number].size = 0;
-        block.inode[inode_number].indirect = 0;
-        for (int j = 0; j < POINTERS_PER_INODE; j++) {
-            if (block.inode[inode_number].direct[j] != 0) {
-                free_block_bitmap[block.inode[inode_number].direct[j]] = 0;
-            }
-            block.inode[inode_number].direct[j] = 0;
-        }
+// drop one reference, the block goes back to the allocator with the last one
+static void block_release(struct fs *fs, int blocknum) {
+	if (blocknum <= 0 || blocknum >= fs->super.nblocks) {
+		return;
+	}
 
-        
-        //write changes
-        disk_write(block_num, block.data);
-        
-        return 1;
-    }
-    
-	return 0;
+	// lock order is dedup_lock before any shard lock
+	if (fs->dedup_index) pthread_mutex_lock(&fs->dedup_lock);
+	struct alloc_shard *shard = shard_of(fs, blocknum);
+	pthread_mutex_lock(&shard->lock);
+	if (fs->block_info) {
+		struct fs_blockinfo *info = &fs->block_info[blocknum];
+		info_mark(fs, blocknum);
+		if (info->refs > 1) {
+			info->refs--;
+		} else {
+			if (info->hash && fs->dedup_index) {
+				dedup_remove(fs, info->hash, blocknum);
+			}
+			info->refs = 0;
+			info->hash = 0;
+			block_free(fs, blocknum);
+		}
+	} else {
+		block_free(fs, blocknum);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (fs->dedup_index) pthread_mutex_unlock(&fs->dedup_lock);
 }
 
-int fs_getsize( int inumber ) {
-	// read block from inumber
-	union fs_block block;
-	int block_num = get_block_num(inumber);
-	disk_read(block_num, block.data);
+// set or clear the content hash of a block, called with dedup_lock held
+static void block_set_hash(struct fs *fs, int blocknum, uint64_t hash) {
+	struct alloc_shard *shard = shard_of(fs, blocknum);
+	pthread_mutex_lock(&shard->lock);
+	struct fs_blockinfo *info = &fs->block_info[blocknum];
+	if (info->hash) {
+		dedup_remove(fs, info->hash, blocknum);
+	}
+	info->hash = hash;
+	if (hash) {
+		dedup_insert(fs, hash, blocknum);
+	}
+	info_mark(fs, blocknum);
+	pthread_mutex_unlock(&shard->lock);
+}
 
-    //translate inumber to inode (get array location)
-    int inode_number = inumber - ((block_num-1)*INODES_PER_BLOCK);
+// find a block already holding exactly this content, called with dedup_lock held
+static int dedup_find(struct fs *fs, uint64_t hash, const char *data) {
+	int blocknum = dedup_lookup(fs, hash);
+	if (!blocknum) {
+		return 0;
+	}
 
-	if (block.inode[inode_number].isvalid) {	// only return size if valid inode
-		return block.inode[inode_number].size;
+	union fs_block existing;
+	if (!block_read(fs, blocknum, existing.data)) {
+		return 0; // never share a block that no longer holds what was hashed
 	}
-	return -1;
+	if (memcmp(existing.data, data, DISK_BLOCK_SIZE) != 0) {
+		return 0; // hash collision
+	}
+	return blocknum;
 }
 
-// when scanning free_block_bitmap, start at index 1 bc 0 is not used (block number of 0 indicates null pointer)
+// store one block of file content that currently lives in old (0 if none);
+// returns the block now holding it, which may be old, a shared duplicate or a new block
+static int block_store(struct fs *fs, int old, const char *data, int hint) {
+	uint64_t hash = 0;
+
+	if (fs->dedup_index) {
+		hash = block_hash(data);
+		pthread_mutex_lock(&fs->dedup_lock);
+		int dup = dedup_find(fs, hash, data);
+		if (dup && dup != old) {
+			block_ref(fs, dup);
+		} else if (!dup && old && block_refs(fs, old) == 1) {
+			// once old is out of the index nobody else can start sharing it
+			block_set_hash(fs, old, 0);
+		}
+		pthread_mutex_unlock(&fs->dedup_lock);
 
-int fs_read( int inumber, char *data, int length, int offset ) {
+		if (dup) {
+			if (dup != old) {
+				block_release(fs, old);
+			}
+			return dup;
+		}
+	}
 
-    int block_num = get_block_num(inumber);
+	int target = old;
+	if (!old || block_refs(fs, old) > 1) {
+		target = block_alloc(fs, hint);
+		if (!target) {
+			return 0;
+		}
+	}
 
-    union fs_block block;
+	block_write(fs, target, data);
 
-    disk_read(0, block.data);
+	if (hash) {
+		pthread_mutex_lock(&fs->dedup_lock);
+		block_set_hash(fs, target, hash);
+		pthread_mutex_unlock(&fs->dedup_lock);
+	}
+	if (target != old) {
+		block_release(fs, old);
+	}
+	return target;
+}
 
-    if (block_num > block.super.ninodeblocks || block_num == 0)
-    {
-        printf("Error: Block number is out of bounds.\n");
-        return 0;
-    }
+// file block mapping
 
-    disk_read(block_num, block.data);
+static void file_init(struct fs_file *file, int inumber) {
+	memset(&file->inode, 0, sizeof(file->inode));
+	for (int level = 0; level < INDIRECT_LEVELS; level++) {
+		for (int depth = 0; depth < INDIRECT_LEVELS; depth++) {
+			file->map[level][depth].blocknum = 0;
+			file->map[level][depth].dirty = 0;
+		}
+	}
+	file->inumber = inumber;
+	file->map_lock = 0;
+	file->inode_dirty = 0;
+	file->writeback = 0;
+	file->stage = 0;
+}
 
+static int file_load(struct fs *fs, struct fs_file *file, int inumber) {
+	file_init(file, inumber);
+	if (!fs->is_mounted) {
+		printf("Error: filesystem is not mounted\n");
+		return 0;
+	}
+	if (!inumber_in_range(fs, inumber)) {
+		printf("Error: inode number is out of bounds.\n");
+		return 0;
+	}
 
+	if (!inode_load(fs, inumber, &file->inode)) {
+		return 0;
+	}
 
-    struct fs_inode inode;
+	if (!file->inode.isvalid) {
+		printf("Error: Invalid inode\n");
+		return 0;
+	}
+	return 1;
+}
 
-    inode = block.inode[inumber % 128];
+static void map_flush(struct fs *fs, struct fs_map *map) {
+	if (map->dirty) {
+		block_write(fs, map->blocknum, map->block.data);
+		map->dirty = 0;
+	}
+}
 
+// make map hold blocknum, writing back whatever it held before; 0 if
+// blocknum fails its checksum, and the map then holds nothing
+static struct fs_map *map_load(struct fs *fs, struct fs_map *map, int blocknum) {
+	if (map->blocknum != blocknum) {
+		map_flush(fs, map);
+		if (!block_read(fs, blocknum, map->block.data)) {
+			map->blocknum = 0;
+			return 0;
+		}
+		map->blocknum = blocknum;
+	}
+	return map;
+}
 
+// find the tree a logical block is in, and its index within that tree
+static int file_locate(struct fs *fs, int64_t lblock, int64_t *index) {
+	lblock -= direct_count(fs);
+	for (int level = 1; level <= indirect_count(fs); level++) {
+		if (lblock < tree_span(level)) {
+			*index = lblock;
+			return level;
+		}
+		lblock -= tree_span(level);
+	}
+	return 0;
+}
 
-    //check for error
+// 0 for a hole, -1 if an indirect block on the way fails its checksum
+static int file_get_block(struct fs *fs, struct fs_file *file, int64_t lblock) {
+	int64_t index;
 
-    if (!inode.isvalid)
-    {
-        printf("Error: Invalid inode\n");
-        return 0;
-    }
-    else if (inode.size == 0)
-    {
-        printf("Error: Inode's size is 0\n");
-        return 0;
-    }
-    else if (inode.size < offset)
-    {
-        printf("Error: Offset out of bounds\n");
-        return 0;
-    }
+	if (lblock < direct_count(fs)) {
+		return file->inode.direct[lblock];
+	}
+	int level = file_locate(fs, lblock, &index);
+	if (!level) {
+		return 0;
+	}
 
+	// shared open files take map_lock, readers of one may run side by side
+	if (file->map_lock) pthread_mutex_lock(file->map_lock);
+	int blocknum = file->inode.indirect[level - 1];
+	for (int depth = 0; depth < level && blocknum > 0; depth++) {
+		struct fs_map *map = map_load(fs, &file->map[level - 1][depth], blocknum);
+		blocknum = map ? map->block.pointers[index / tree_span(level - 1 - depth) % POINTERS_PER_BLOCK] : -1;
+	}
+	if (file->map_lock) pthread_mutex_unlock(file->map_lock);
+	return blocknum;
+}
 
+static int file_set_block(struct fs *fs, struct fs_file *file, int64_t lblock, int blocknum) {
+	int64_t index;
 
+	if (lblock < direct_count(fs)) {
+		file->inode.direct[lblock] = blocknum;
+		file->inode_dirty = 1;
+		return 1;
+	}
+	int level = file_locate(fs, lblock, &index);
+	if (!level) {
+		return 0;
+	}
 
-    int direct_index_num = offset / DISK_BLOCK_SIZE;
-    if (direct_index_num > 5)
-    {
-        printf("Error: Direct block index out of bounds\n");
-        return 0;
-    }
+	// walk down from the inode, allocating missing indirect blocks and giving
+	// any still shared with a snapshot a copy of their own on the way
+	int *pointer = &file->inode.indirect[level - 1];
+	int *dirty = &file->inode_dirty;
+	for (int depth = 0; depth < level; depth++) {
+		struct fs_map *map = &file->map[level - 1][depth];
+		if (!*pointer) {
+			int fresh = block_alloc(fs, file->inumber);
+			if (!fresh) {
+				return 0;
+			}
+			map_flush(fs, map);
+			memset(map->block.data, 0, DISK_BLOCK_SIZE);
+			map->blocknum = fresh;
+			map->dirty = 1;
+			*pointer = fresh;
+			*dirty = 1;
+		} else {
+			if (!map_load(fs, map, *pointer)) {
+				return 0;
+			}
+			if (block_refs(fs, *pointer) > 1) {
+				int copy = block_alloc(fs, file->inumber);
+				if (!copy) {
+					return 0;
+				}
+				block_release(fs, *pointer);
+				map->blocknum = copy;
+				map->dirty = 1;
+				*pointer = copy;
+				*dirty = 1;
+			}
+		}
+		pointer = &map->block.pointers[index / tree_span(level - 1 - depth) % POINTERS_PER_BLOCK];
+		dirty = &map->dirty;
+	}
 
-    if (inode.size < length + offset)
-    {
-        length = inode.size - offset;
-    }
+	*pointer = blocknum;
+	*dirty = 1;
+	return 1;
+}
 
-    union fs_block directblock;
-    int totalbytesread = 0;
-    memset(data, 0, length);
-    int tempbytesread = DISK_BLOCK_SIZE;
-    while (direct_index_num < 5 && totalbytesread < length)
-    {
-        disk_read(inode.direct[direct_index_num], directblock.data);
-        if (tempbytesread + totalbytesread > length)
-        {
-            tempbytesread = length - totalbytesread;
-        }
-        strncat(data, directblock.data, tempbytesread);
-        direct_index_num++;
-        totalbytesread += tempbytesread;
-    }
+// visit every block below an indirect block with depth levels of indirect
+// blocks, then the block itself; a block is read before it is visited, so
+// visiting may free it. an indirect block that can't be read is neither
+// followed nor visited, and the walk returns 0
+static int tree_walk(struct fs *fs, int blocknum, int depth, void (*visit)(struct fs *, int), int (*read)(struct fs *, int, char *)) {
+	int ok = 1;
+	if (blocknum <= 0 || blocknum >= fs->super.nblocks) {
+		return 1;
+	}
+	if (depth > 0) {
+		union fs_block map;
+		if (!read(fs, blocknum, map.data)) {
+			return 0;
+		}
+		for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+			if (map.pointers[k]) {
+				ok &= tree_walk(fs, map.pointers[k], depth - 1, visit, read);
+			}
+		}
+	}
+	if (visit) visit(fs, blocknum);
+	return ok;
+}
 
+static int inode_walk(struct fs *fs, struct fs_inode *inode, void (*visit)(struct fs *, int), int (*read)(struct fs *, int, char *)) {
+	int ok = 1;
+	for (int k = 0; k < direct_count(fs); k++) {
+		ok &= tree_walk(fs, inode->direct[k], 0, visit, read);
+	}
+	for (int level = 1; level <= indirect_count(fs); level++) {
+		ok &= tree_walk(fs, inode->indirect[level - 1], level, visit, read);
+	}
+	return ok;
+}
 
+// every indirect block an inode points to still matches its checksum;
+// walked before references change, so a bad tree fails without half the
+// references taken or dropped
+static int inode_verify(struct fs *fs, struct fs_inode *inode) {
+	return !checksums_enabled(fs) || inode_walk(fs, inode, 0, block_read);
+}
 
-    // read from indirect block if we still have bytes left to be read
+// take or drop one reference on every block an inode points to
+static void inode_ref_blocks(struct fs *fs, struct fs_inode *inode) {
+	inode_walk(fs, inode, block_ref, block_read);
+}
 
-    if (totalbytesread < length)
-    {
-        // read in the indirect block
-        union fs_block indirectblock;
-        union fs_block tempblock;
-        disk_read(inode.indirect, indirectblock.data);
+static void inode_release_blocks(struct fs *fs, struct fs_inode *inode) {
+	inode_walk(fs, inode, block_release, block_read);
+}
 
+static void file_sync(struct fs *fs, struct fs_file *file) {
+	for (int level = 0; level < INDIRECT_LEVELS; level++) {
+		for (int depth = 0; depth < INDIRECT_LEVELS; depth++) {
+			map_flush(fs, &file->map[level][depth]);
+		}
+	}
+	if (file->inode_dirty) {
+		inode_save(fs, file->inumber, &file->inode);
+		file->inode_dirty = 0;
+	}
+	info_flush(fs);
+}
 
+// open inodes
 
-        // iterate through the indirect data blocks
+static struct open_inode **open_slot(struct fs *fs, int inumber) {
+	struct open_inode **slot = &fs->open_table[(unsigned)inumber % OPEN_BUCKETS];
+	while (*slot && (*slot)->inumber != inumber) {
+		slot = &(*slot)->next;
+	}
+	return slot;
+}
 
-        int indirectblocks;
+// callers hold the inode lock
+static struct open_inode *open_find(struct fs *fs, int inumber) {
+	pthread_mutex_lock(&fs->open_lock);
+	struct open_inode *open = *open_slot(fs, inumber);
+	pthread_mutex_unlock(&fs->open_lock);
+	return open;
+}
 
-        if (inode.size % DISK_BLOCK_SIZE == 0)
-        {
-            indirectblocks = inode.size / DISK_BLOCK_SIZE - 5;
-        }
-        else
-        {
-            indirectblocks = inode.size / DISK_BLOCK_SIZE - 5 + 1;
-        }
+// the inode is gone; handles still pointing at it fail from now on
+static void open_forget(struct fs *fs, int inumber) {
+	pthread_mutex_lock(&fs->open_lock);
+	struct open_inode **slot = open_slot(fs, inumber);
+	if (*slot) {
+		(*slot)->dead = 1;
+		*slot = (*slot)->next;
+	}
+	pthread_mutex_unlock(&fs->open_lock);
+}
+
+// write back every open inode; callers hold the fs lock exclusively
+static void open_flush_all(struct fs *fs) {
+	for (int i = 0; i < OPEN_BUCKETS; i++) {
+		for (struct open_inode *open = fs->open_table[i]; open; open = open->next) {
+			file_sync(fs, &open->file);
+		}
+	}
+}
+
+// the file to work on: the in-memory copy if the inode is open, otherwise
+// scratch loaded from disk; callers hold the inode lock
+static struct fs_file *file_get(struct fs *fs, struct fs_file *scratch, int inumber) {
+	if (fs->is_mounted && inumber_in_range(fs, inumber)) {
+		struct open_inode *open = open_find(fs, inumber);
+		if (open) {
+			return &open->file;
+		}
+	}
+	return file_load(fs, scratch, inumber) ? scratch : 0;
+}
+
+static void inode_get(struct fs *fs, int inumber, struct fs_inode *inode) {
+	struct fs_file file;
+	struct fs_file *f = file_get(fs, &file, inumber);
+	if (f) {
+		*inode = f->inode;
+	} else {
+		memset(inode, 0, sizeof(*inode));
+	}
+}
+
+static int file_delete(struct fs *fs, struct fs_file *file) {
+	// the tree is walked on disk, so cached indirect blocks go out first
+	file_sync(fs, file);
+	if (!inode_verify(fs, &file->inode)) {
+		return 0;
+	}
+	inode_release_blocks(fs, &file->inode);
+	memset(&file->inode, 0, sizeof(file->inode));
+	file->inode_dirty = 1;
+	file_sync(fs, file);
+	open_forget(fs, file->inumber);
+	return 1;
+}
 
-        int i;
+static void unmount_locked(struct fs *fs) {
+	// handles outlive the mount but can no longer be used
+	open_flush_all(fs);
+	pthread_mutex_lock(&fs->open_lock);
+	for (int i = 0; i < OPEN_BUCKETS; i++) {
+		for (struct open_inode *open = fs->open_table[i]; open; open = open->next) {
+			open->dead = 1;
+		}
+		fs->open_table[i] = 0;
+	}
+	pthread_mutex_unlock(&fs->open_lock);
 
-        tempbytesread = DISK_BLOCK_SIZE;
+	discard_flush(fs);
+	for (int i = 0; i < fs->nshards; i++) {
+		pthread_mutex_destroy(&fs->alloc_shards[i].lock);
+	}
+	free(fs->alloc_shards);
+	free(fs->free_block_bitmap);
+	free(fs->block_info);
+	free(fs->info_dirty);
+	free(fs->dedup_index);
+	fs->alloc_shards = 0;
+	fs->nshards = 0;
+	fs->free_block_bitmap = 0;
+	fs->block_info = 0;
+	fs->info_dirty = 0;
+	fs->dedup_index = 0;
+	fs->is_mounted = 0;
+}
 
-        for (i = 0; (i < indirectblocks) && (totalbytesread < length); i++)
-        {
+int fs_ctx_format( struct fs *fs ) {
+	return fs_ctx_format_features(fs, 0);
+}
 
-            disk_read(indirectblock.pointers[i], tempblock.data);
+int fs_parse_features( const char *list ) {
+	static const struct { const char *name; int feature; } names[] = {
+		{ "dedup", FS_FEATURE_DEDUP },
+		{ "snapshots", FS_FEATURE_SNAPSHOTS },
+		{ "dirs", FS_FEATURE_DIRS },
+		{ "checksums", FS_FEATURE_CHECKSUMS },
+		{ "large", FS_FEATURE_LARGE },
+		{ "none", 0 },
+	};
+	int features = 0;
+
+	while (*list) {
+		list += strspn(list, ", \t\n");
+		size_t len = strcspn(list, ", \t\n");
+		if (!len) break;
+		size_t i;
+		for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if (strlen(names[i].name) == len && !strncmp(list, names[i].name, len)) {
+				features |= names[i].feature;
+				break;
+			}
+		}
+		if (i == sizeof(names) / sizeof(names[0])) {
+			return -1;
+		}
+		list += len;
+	}
+	return features;
+}
 
+// the superblock a fresh filesystem on this disk would get
+static int format_super(struct fs *fs, int features, struct fs_superblock *sb) {
+	memset(sb, 0, sizeof(*sb));
+	// block numbers are 32 bits wide on disk and in the allocator
+	if (disk_ctx_size(fs->disk) > INT32_MAX) {
+		printf("Format failed: disk has more than %d blocks\n", INT32_MAX);
+		return 0;
+	}
+	// set aside 10% of blocks for inodes, but no more than keeps every
+	// inumber within an int; past that the extra blocks go to data
+	int64_t ninodeblocks = ceil(.1 * (double)disk_ctx_size(fs->disk));
+	if (ninodeblocks > MAX_INODE_BLOCKS) {
+		ninodeblocks = MAX_INODE_BLOCKS;
+	}
+	sb->ninodeblocks = ninodeblocks;
+	sb->ninodes = (int64_t)INODES_PER_BLOCK * ninodeblocks;
+	sb->magic = FS_MAGIC;
+	sb->nblocks = disk_ctx_size(fs->disk);
+	sb->features = features;
+	if (features & (FS_FEATURE_DEDUP | FS_FEATURE_SNAPSHOTS | FS_FEATURE_CHECKSUMS)) {
+		sb->ninfoblocks = (disk_ctx_size(fs->disk) + INFOS_PER_BLOCK - 1) / INFOS_PER_BLOCK;
+	}
+	if (features & FS_FEATURE_SNAPSHOTS) {
+		sb->snaptable = 1 + sb->ninodeblocks + sb->ninfoblocks;
+	}
 
+	int nmeta = sb->ninodeblocks + sb->ninfoblocks + (sb->snaptable ? 1 : 0);
+	if (1 + nmeta >= disk_ctx_size(fs->disk)) {
+		printf("Format failed: disk is too small\n");
+		return 0;
+	}
+	return 1;
+}
 
-            // adjust tempbytesread variable if we have reached the end of the inode
-            if (tempbytesread + totalbytesread > length)
-            {
-                tempbytesread = length - totalbytesread;
-            }
+static int format_locked(struct fs *fs, int features) {
+	union fs_block block;
+	union fs_block root;
 
+	if (fs->is_mounted) { //check if the filesystem is already mounted
+		printf("Format failed: the filesystem is already mounted\n");
+	 	return 0;
+	}
 
+    //create superblock
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	if (!format_super(fs, features, &block.super)) {
+		return 0;
+	}
+	struct fs_superblock sb = block.super;
+	int nmeta = sb.ninodeblocks + sb.ninfoblocks + (sb.snaptable ? 1 : 0);
 
-            // append read data to our data variable
-            strncat(data, tempblock.data, tempbytesread);
-            totalbytesread += tempbytesread;
+	// write changes to disk
+	disk_ctx_write(fs->disk, 0, block.data);
 
-        }
+	// clear inode table, block info table and snapshot table
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	for (int i = 1; i <= nmeta; i++) {
+		disk_ctx_write(fs->disk, i, block.data);
+	}
 
-    }
+	// the root directory starts out empty, its index is built on the first entry
+	int rootblock = get_block_num(ROOT_INUMBER);
+	memset(root.data, 0, DISK_BLOCK_SIZE);
+	if (features & FS_FEATURE_DIRS) {
+		root.inode[ROOT_INUMBER].isvalid = INODE_DIR;
+		disk_ctx_write(fs->disk, rootblock, root.data);
+	}
 
+	// checksums of the metadata just written go straight into the info table
+	if (features & FS_FEATURE_CHECKSUMS) {
+		uint32_t zero_crc = crc32c(0, block.data, DISK_BLOCK_SIZE);
+		uint32_t root_crc = crc32c(0, root.data, DISK_BLOCK_SIZE);
+		for (int i = 0; i < sb.ninfoblocks; i++) {
+			memset(block.data, 0, DISK_BLOCK_SIZE);
+			for (int k = 0; k < INFOS_PER_BLOCK; k++) {
+				int b = i * INFOS_PER_BLOCK + k;
+				if ((b >= 1 && b <= sb.ninodeblocks) || (sb.snaptable && b == sb.snaptable)) {
+					block.info[k].crc = (b == rootblock) ? root_crc : zero_crc;
+				}
+			}
+			disk_ctx_write(fs->disk, 1 + sb.ninodeblocks + i, block.data);
+		}
+	}
 
+	return 1;
+}
 
-    // return the total number of bytes read (could be smaller than the number requested)
+int fs_ctx_format_features( struct fs *fs, int features ) {
+	fs_lock_exclusive(fs);
+	int result = format_locked(fs, features);
+	fs_unlock(fs);
+	return result;
+}
 
-    return totalbytesread;
+// print the data blocks below an indirect block with depth levels of indirect blocks
+static void debug_tree(struct fs *fs, int blocknum, int depth, int nblocks) {
+	union fs_block map;
 
+	if (blocknum <= 0 || blocknum >= nblocks) {
+		return;
+	}
+	if (depth == 0) {
+		printf("%d ", blocknum);
+		return;
+	}
+	disk_ctx_read(fs->disk, blocknum, map.data);
+	for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+		debug_tree(fs, map.pointers[k], depth - 1, nblocks);
+	}
 }
-/*
-int fs_write( int inumber, const char *data, int length, int offset )
-{
-    //INPUT CHECKING
-    int data_length = strlen(data);
-    if (data_length < offset + length) {        //checking that offset and length data is possible
-        return 0;
-    }
-    if (inumber > block.super.ninodes) {        //checking that inumber is within number of possible inodes
-        return 0;
-    }
-    
-    
-    // read block from inumber
-    union fs_block block;
-    int block_num = get_block_num(inumber);
-    disk_read(block_num, block.data);
-
-    //translate inumber to inode (get array location)
-    int inode_number = inumber - ((block_num-1)*INODES_PER_BLOCK);
-
-    if (block.inode[inode_number].isvalid) {    // only return size if valid inode
-        char copied_data[length];
-        strncpy(copied_data, data + offset, length);
-        
-        //start writing copied data to blocks in direct
-        
-        
-    }
-    
-	return 0;
+
+static void debug_locked(struct fs *fs) {
+	static const char *level_names[INDIRECT_LEVELS] = { "indirect", "double indirect", "triple indirect" };
+	int inum;
+	struct fs_inode inode;
+	union fs_block block;
+	disk_ctx_read(fs->disk, 0,block.data); //read in super block
+	printf("superblock:\n");
+	if (verify_magic_num(block.super.magic))
+		printf("    magic number is valid\n");
+	else {
+		printf("    magic number is not valid\n");
+		return;
+	}
+	printf("    %d blocks\n",block.super.nblocks);
+	printf("    %d inode blocks\n",block.super.ninodeblocks);
+	printf("    %d inodes\n",block.super.ninodes);
+
+	struct fs_superblock sb = block.super;
+	if (sb.features & FS_FEATURE_DEDUP) {
+		printf("    dedup enabled, %d block info blocks\n", sb.ninfoblocks);
+	}
+	if (sb.features & FS_FEATURE_SNAPSHOTS) {
+		printf("    snapshots enabled, snapshot table at block %d\n", sb.snaptable);
+	}
+	if (sb.features & FS_FEATURE_DIRS) {
+		printf("    directories enabled, root is inode %d\n", ROOT_INUMBER);
+	}
+	if (sb.features & FS_FEATURE_CHECKSUMS) {
+		printf("    checksums enabled (crc32c, %s)\n", crc32c_hw_available() ? "sse4.2" : "software");
+	}
+	int large = sb.features & FS_FEATURE_LARGE;
+	if (large) {
+		printf("    large format, 64-bit file sizes, %d direct and %d levels of indirect blocks\n", LARGE_DIRECT, INDIRECT_LEVELS);
+	}
+
+	for (int i = 1; i <= sb.ninodeblocks; i++) {  //traverse inode blocks
+
+		disk_ctx_read(fs->disk, i, block.data); //read in inode block
+
+
+		for (int z = 0; z < INODES_PER_BLOCK; z++) {//scan through inodes
+
+			inode_decode_as(large, &block, z, &inode);
+			if (inode.isvalid) { //verify inode is valid
+			    inum = (i- 1)*INODES_PER_BLOCK + z;
+				printf("inode %d%s:\n", inum, inode.isvalid == INODE_DIR ? " (directory)" : "");
+				printf("    size: %lld bytes\n", (long long)inode.size);
+
+
+				if (inode.size > 0) { //go through direct pointers
+					printf("    direct blocks: ");
+					print_blocks(inode.direct, large ? LARGE_DIRECT : POINTERS_PER_INODE);
+				}
+
+
+				for (int level = 1; level <= (large ? INDIRECT_LEVELS : 1); level++) { //go through indirect pointers
+					if (inode.indirect[level - 1] != 0) {
+						printf("    %s block: %d\n", level_names[level - 1], inode.indirect[level - 1]);
+						printf("    %s data blocks: ", level_names[level - 1]);
+						debug_tree(fs, inode.indirect[level - 1], level, sb.nblocks);
+						printf("\n");
+					}
+				}
+			}
+		}
+	}
+
+	if (sb.features & FS_FEATURE_DEDUP) {
+		// every reference beyond the first is a block that dedup saved
+		long logical = 0, physical = 0, shared = 0;
+		for (int i = 0; i < sb.ninfoblocks; i++) {
+			disk_ctx_read(fs->disk, 1 + sb.ninodeblocks + i, block.data);
+			for (int k = 0; k < INFOS_PER_BLOCK; k++) {
+				if (block.info[k].hash && block.info[k].refs) {
+					logical += block.info[k].refs;
+					physical++;
+					if (block.info[k].refs > 1) shared++;
+				}
+			}
+		}
+		printf("dedup:\n");
+		printf("    %ld data block references\n", logical);
+		printf("    %ld unique data blocks (%ld shared)\n", physical, shared);
+		printf("    %ld blocks saved (%.1f%%)\n", logical - physical,
+			logical ? 100.0 * (logical - physical) / logical : 0.0);
+	}
+
+	if (sb.features & FS_FEATURE_SNAPSHOTS) {
+		disk_ctx_read(fs->disk, sb.snaptable, block.data);
+		for (int i = 0; i < (int)SNAPSHOTS_PER_BLOCK; i++) {
+			if (block.snapshot[i].isvalid) {
+				printf("snapshot %d:\n", block.snapshot[i].id);
+				printf("    %d files, inode table map at block %d\n", block.snapshot[i].nfiles, block.snapshot[i].mapblock);
+			}
+		}
+	}
+
+}
+
+static void mark_block(struct fs *fs, int blocknum) {
+	fs->free_block_bitmap[blocknum] = 1;
+}
+
+static void mark_inode_blocks(struct fs *fs, struct fs_inode *inode) {
+	inode_walk(fs, inode, mark_block, block_read);
+}
+
+// split the blocks into shards that each cover whole info table blocks
+static int shards_init(struct fs *fs) {
+	int per_shard = (fs->super.nblocks + ALLOC_SHARDS - 1) / ALLOC_SHARDS;
+	fs->shard_blocks = (per_shard + INFOS_PER_BLOCK - 1) / INFOS_PER_BLOCK * INFOS_PER_BLOCK;
+	fs->nshards = (fs->super.nblocks + fs->shard_blocks - 1) / fs->shard_blocks;
+	fs->alloc_shards = calloc(fs->nshards, sizeof(*fs->alloc_shards));
+	if (!fs->alloc_shards) {
+		fs->nshards = 0;
+		return 0;
+	}
+	for (int i = 0; i < fs->nshards; i++) {
+		struct alloc_shard *shard = &fs->alloc_shards[i];
+		pthread_mutex_init(&shard->lock, 0);
+		shard->start = i * fs->shard_blocks;
+		shard->end = shard->start + fs->shard_blocks;
+		if (shard->start < fs->data_start) shard->start = fs->data_start;
+		if (shard->end > fs->super.nblocks) shard->end = fs->super.nblocks;
+		if (shard->end < shard->start) shard->end = shard->start;
+		shard->next = shard->start;
+	}
+	return 1;
+}
+
+static int mount_locked(struct fs *fs) {
+	union fs_block block;
+
+	// check magic number
+	disk_ctx_read(fs->disk, 0,block.data);
+	int valid_super_block = verify_magic_num(block.super.magic);
+	if (!valid_super_block) {
+		printf("Invalid superblock\n");
+		return 0;
+	}
+	// older formats of very large disks overflowed the inode count
+	if (block.super.ninodeblocks < 1 || block.super.ninodeblocks > MAX_INODE_BLOCKS ||
+	    block.super.ninodes != INODES_PER_BLOCK * block.super.ninodeblocks) {
+		printf("Invalid superblock: bad inode count\n");
+		return 0;
+	}
+
+	if (fs->is_mounted) {
+		unmount_locked(fs);
+	}
+
+	fs->super = block.super;
+	fs->data_start = 1 + fs->super.ninodeblocks + fs->super.ninfoblocks + (fs->super.snaptable ? 1 : 0);
+	fs->free_block_bitmap = calloc(fs->super.nblocks, 1);
+	if (!fs->free_block_bitmap) {
+		return 0;
+	}
+
+	// superblock, inode table and info table are never handed out
+	memset(fs->free_block_bitmap, 1, fs->data_start);
+	if (!shards_init(fs)) {
+		unmount_locked(fs);
+		return 0;
+	}
+
+	if (fs->super.ninfoblocks) {
+		// the info table already records which blocks are in use
+		fs->block_info = malloc((size_t)fs->super.ninfoblocks * DISK_BLOCK_SIZE);
+		fs->info_dirty = calloc(fs->super.ninfoblocks, 1);
+		if (!fs->block_info || !fs->info_dirty) {
+			unmount_locked(fs);
+			return 0;
+		}
+		for (int i = 0; i < fs->super.ninfoblocks; i++) {
+			disk_ctx_read(fs->disk, 1 + fs->super.ninodeblocks + i, (char *)&fs->block_info[i * INFOS_PER_BLOCK]);
+		}
+
+		if (fs->super.features & FS_FEATURE_DEDUP) {
+			size_t slots = 2;
+			while (slots < (size_t)fs->super.nblocks * 2) slots <<= 1;
+			fs->dedup_index = calloc(slots, sizeof(*fs->dedup_index));
+			fs->dedup_mask = slots - 1;
+			if (!fs->dedup_index) {
+				unmount_locked(fs);
+				return 0;
+			}
+		}
+
+		for (int i = fs->data_start; i < fs->super.nblocks; i++) {
+			if (fs->block_info[i].refs) {
+				fs->free_block_bitmap[i] = 1;
+				if (fs->dedup_index && fs->block_info[i].hash) {
+					dedup_insert(fs, fs->block_info[i].hash, i);
+				}
+			}
+		}
+	} else {
+		// scan through all inodes and record which blocks in use
+		for (int i = 1; i <= fs->super.ninodeblocks; i++){
+			disk_ctx_read(fs->disk, i, block.data);
+			for (int j = 0; j < INODES_PER_BLOCK; j++) {
+				struct fs_inode inode;
+				inode_decode(fs, &block, j, &inode);
+				if (inode.isvalid) {
+					mark_inode_blocks(fs, &inode);
+				}
+			}
+		}
+	}
+
+	// prepare fs for use
+	fs->is_mounted = 1;
+	return 1;
+
+}
+
+int fs_ctx_mount( struct fs *fs ) {
+	fs_lock_exclusive(fs);
+	int result = mount_locked(fs);
+	fs_unlock(fs);
+	return result;
+}
+
+int fs_ctx_unmount( struct fs *fs ) {
+	fs_lock_exclusive(fs);
+	int result = fs->is_mounted;
+	if (fs->is_mounted) {
+		unmount_locked(fs);
+	}
+	fs_unlock(fs);
+	return result;
 }
+
+//how do we know where to store new inode?
+//how do we access superblock to get number of inodes so we can do block.inode[ninodes] to set inode
+//inodes should start as valid correct
+//do we need to traverse inodes to know where to create?
+
+/*
+struct fs_inode {
+    int isvalid;
+    int size;
+    int direct[POINTERS_PER_INODE];
+    int indirect;
+};
  */
+//iterates through blocks to find first free inode and sets it to valid, returns 0 if fails
 
+//POSSIBLE SUGGESTION: have inode numbers start at 1, but the inodes themselves are placed starting at position 0
 
+void fs_ctx_debug( struct fs *fs ) {
+	fs_lock_exclusive(fs);
+	if (fs->is_mounted) {
+		open_flush_all(fs);
+	}
+	debug_locked(fs);
+	fs_unlock(fs);
+}
 
-int fs_write( int inumber, const char *data, int length, int offset ) {
-    
-    // read block from inumber
-    int block_num = get_block_num(inumber);
+static int inode_create(struct fs *fs, int type, int named) {
     union fs_block block;
-    disk_read(0, block.data);
+    union fs_block iblock;
 
-    if (block_num > block.super.ninodeblocks || block_num == 0)
-    {
-        printf("Error: Block number is out of bounds.\n");
+    if (!fs->is_mounted) {
+        printf("Error: filesystem is not mounted\n");
         return 0;
     }
-    //fetch block
-    disk_read(block_num, block.data);
 
-    //check for error
-    if (!block.inode[inumber % 128].isvalid)
-    {
-        printf("Error: Invalid inode\n");
-        return 0;
-    }
+    disk_ctx_read(fs->disk, 0, block.data); //read in superblock
 
 
-    int direct_index_num = offset / DISK_BLOCK_SIZE;
-    if (direct_index_num > 5)
-    {
-        printf("Error: Direct block index out of bounds\n");
-        return 0;
-    }
-    
-    union fs_block directblock;
-    int totalbyteswritten = 0;
-    int tempbyteswritten = DISK_BLOCK_SIZE;
-    while (direct_index_num < 5 && totalbyteswritten < length)
-    {
-        printf("BLOCK NUMBER: %d \n", block.inode[inumber % 128].direct[direct_index_num]);
-        if (block.inode[inumber % 128].direct[direct_index_num] == 0) {
-            int free_block_num = first_free_block();
-            //int free_block_num = 3;
-            printf("NEW BLOCK NUMBER: %d \n", free_block_num);
-            
-            block.inode[inumber % 128].direct[direct_index_num] = free_block_num;
-            block.inode[inumber % 128].size += tempbyteswritten;
-            
-            //get block to write to
-            union fs_block wblock;
-            strncpy(wblock.data, data + totalbyteswritten, tempbyteswritten);
-            disk_write(free_block_num, wblock.data);
-            disk_write(block_num, block.data);
-            
-            //increment bytes_written
-            free_block_bitmap[free_block_num] = 1;
-            totalbyteswritten += tempbyteswritten;
-        }
-        /*
-        disk_read(inode.direct[direct_index_num], directblock.data);
-        if (tempbytesread + totalbytesread > length)
-        {
-            tempbytesread = length - totalbytesread;
+
+    int found = 0;
+    int inm = 0;
+    // check for first free inode
+    for (int i = 1; i <= block.super.ninodeblocks; i++) {
+        pthread_mutex_lock(inode_block_lock(fs, i));
+        if (!block_read(fs, i, iblock.data)) {
+            // writing the block back would bless whatever is wrong with it
+            pthread_mutex_unlock(inode_block_lock(fs, i));
+            return 0;
         }
-        strncat(data, directblock.data, tempbytesread);
-        direct_index_num++;
-        totalbytesread += tempbytesread;
-         */
-        direct_index_num++;
-    }
 
-    return totalbyteswritten;
-}
+        for (int k = 0; k < INODES_PER_BLOCK; k++) {
 
+            int temp_inm = ((i-1)*INODES_PER_BLOCK)+k;
 
-//REMINDER: free blocks in direct when deleting inode
+            //if inode is free, set it to be valid and zero all other variables
+            if(iblock.inode[k].isvalid == 0 && temp_inm != 0)
+            {
+                struct fs_inode inode = {0};
+                inode.isvalid = type;
+                inode.named = named;
+                inode_encode(fs, &iblock, k, &inode);
 
-//is bitmap to big? we only have 5 blocks apparently
+                //getting inumber based on array location (k) and block location (i)
+                inm = temp_inm;
+                found = 1;
+            }
+
+            //write changes if new inode is created, increment number of inodes and return inumber
+            if(found != 0)
+            {
+                block_write(fs, i, iblock.data);
+                pthread_mutex_unlock(inode_block_lock(fs, i));
+                info_flush(fs);
+
+                return inm;
+
+            }
+
+
+        }
+        pthread_mutex_unlock(inode_block_lock(fs, i));
+
+
+    }
+
+
+	return 0;
+}
+
+int fs_ctx_create( struct fs *fs ) {
+	fs_lock_shared(fs);
+	int inumber = inode_create(fs, INODE_FILE, 0);
+	fs_unlock(fs);
+	return inumber;
+}
+
+//sets specified inode to invalid and releases its blocks
+int fs_ctx_delete( struct fs *fs, int inumber ) {
+	struct fs_file file;
+	int result = 0;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_wrlock(inode_lock(fs, inumber));
+	struct fs_file *f = file_get(fs, &file, inumber);
+	if (f && f->inode.isvalid == INODE_DIR) {
+		printf("Error: inode %d is a directory\n", inumber);
+	} else if (f && f->inode.named) {
+		// its name would be left to point at whatever reuses the inumber
+		printf("Error: inode %d has a name in a directory, remove it by path\n", inumber);
+	} else if (f) {
+		result = file_delete(fs, f);
+	}
+	pthread_rwlock_unlock(inode_lock(fs, inumber));
+	fs_unlock(fs);
+
+	return result;
+}
+
+int64_t fs_ctx_getsize( struct fs *fs, int inumber ) {
+	struct fs_inode inode;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_rdlock(inode_lock(fs, inumber));
+	inode_get(fs, inumber, &inode);
+	pthread_rwlock_unlock(inode_lock(fs, inumber));
+	fs_unlock(fs);
+
+	if (inode.isvalid) {	// only return size if valid inode
+		return inode.size;
+	}
+	return -1;
+}
+
+// unallocated blocks inside the file size read back as zeros
+
+static int file_read(struct fs *fs, struct fs_file *file, char *data, int length, int64_t offset) {
+	if (offset < 0 || offset >= file->inode.size || length <= 0) {
+		return 0;
+	}
+	if (length > file->inode.size - offset) {
+		length = file->inode.size - offset;
+	}
+
+	union fs_block block;
+	int totalbytesread = 0;
+	while (totalbytesread < length) {
+		int64_t pos = offset + totalbytesread;
+		int boffset = pos % DISK_BLOCK_SIZE;
+		int n = DISK_BLOCK_SIZE - boffset;
+		if (n > length - totalbytesread) {
+			n = length - totalbytesread;
+		}
+
+		int blocknum = file_get_block(fs, file, pos / DISK_BLOCK_SIZE);
+		if (blocknum < 0) {
+			return -1;
+		}
+		if (blocknum) {
+			if (!block_read(fs, blocknum, block.data)) {
+				return -1;
+			}
+			memcpy(data + totalbytesread, block.data + boffset, n);
+		} else {
+			memset(data + totalbytesread, 0, n);
+		}
+		totalbytesread += n;
+	}
+
+	// return the total number of bytes read (could be smaller than the number requested)
+	return totalbytesread;
+}
+
+int fs_ctx_read( struct fs *fs, int inumber, char *data, int length, int64_t offset ) {
+	struct fs_file file;
+	int result = 0;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_rdlock(inode_lock(fs, inumber));
+	struct fs_file *f = file_get(fs, &file, inumber);
+	if (f) {
+		result = file_read(fs, f, data, length, offset);
+	}
+	pthread_rwlock_unlock(inode_lock(fs, inumber));
+	fs_unlock(fs);
+
+	return result;
+}
+
+static int file_write(struct fs *fs, struct fs_file *file, const char *data, int length, int64_t offset) {
+	if (offset < 0 || length <= 0) {
+		return 0;
+	}
+
+	union fs_block block;
+	int totalbyteswritten = 0;
+	while (totalbyteswritten < length) {
+		int64_t pos = offset + totalbyteswritten;
+		int64_t lblock = pos / DISK_BLOCK_SIZE;
+		int boffset = pos % DISK_BLOCK_SIZE;
+		int n = DISK_BLOCK_SIZE - boffset;
+		if (n > length - totalbyteswritten) {
+			n = length - totalbyteswritten;
+		}
+		if (lblock >= file_max_blocks(fs)) {
+			break;
+		}
+
+		// partial blocks keep whatever the rest of the block already holds
+		int old = file_get_block(fs, file, lblock);
+		if (old < 0) {
+			break;
+		}
+		if (n < DISK_BLOCK_SIZE) {
+			if (old) {
+				if (!block_read(fs, old, block.data)) {
+					break;
+				}
+			} else {
+				memset(block.data, 0, DISK_BLOCK_SIZE);
+			}
+		}
+		memcpy(block.data + boffset, data + totalbyteswritten, n);
+
+		int blocknum = block_store(fs, old, block.data, file->inumber);
+		if (!blocknum) {
+			break;
+		}
+		if (blocknum != old && !file_set_block(fs, file, lblock, blocknum)) {
+			block_release(fs, blocknum);
+			break;
+		}
+		totalbyteswritten += n;
+	}
+
+	if (offset + totalbyteswritten > file->inode.size) {
+		file->inode.size = offset + totalbyteswritten;
+		file->inode_dirty = 1;
+	}
+	if (file->writeback) {
+		info_flush(fs);
+	} else {
+		file_sync(fs, file);
+	}
+
+	return totalbyteswritten;
+}
+
+int fs_ctx_write( struct fs *fs, int inumber, const char *data, int length, int64_t offset ) {
+	struct fs_file file;
+	int result = 0;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_wrlock(inode_lock(fs, inumber));
+	struct fs_file *f = file_get(fs, &file, inumber);
+	if (f && f->inode.isvalid == INODE_DIR) {
+		printf("Error: inode %d is a directory\n", inumber);
+	} else if (f) {
+		result = file_write(fs, f, data, length, offset);
+	}
+	pthread_rwlock_unlock(inode_lock(fs, inumber));
+	fs_unlock(fs);
+
+	return result;
+}
+
+// file handles: the first open of an inode pins it in the open table, with
+// its indirect block loaded, so reads and writes through a handle need only
+// data block I/O
+
+struct fs_handle *fs_ctx_open( struct fs *fs, int inumber ) {
+	struct fs_handle *handle = 0;
+	struct open_inode *open = 0;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_wrlock(inode_lock(fs, inumber));
+	if (fs->is_mounted && inumber_in_range(fs, inumber)) {
+		open = open_find(fs, inumber);
+	}
+	if (!open) {
+		open = calloc(1, sizeof(*open));
+		if (open && file_load(fs, &open->file, inumber) && open->file.inode.isvalid != INODE_DIR) {
+			pthread_mutex_init(&open->map_lock, 0);
+			open->file.map_lock = &open->map_lock;
+			open->file.writeback = 1;
+			open->inumber = inumber;
+			pthread_mutex_lock(&fs->open_lock);
+			open->next = fs->open_table[(unsigned)inumber % OPEN_BUCKETS];
+			fs->open_table[(unsigned)inumber % OPEN_BUCKETS] = open;
+			pthread_mutex_unlock(&fs->open_lock);
+		} else {
+			if (open && open->file.inode.isvalid == INODE_DIR) {
+				printf("Error: inode %d is a directory\n", inumber);
+			}
+			free(open);
+			open = 0;
+		}
+	}
+	if (open) {
+		handle = calloc(1, sizeof(*handle));
+		if (handle) {
+			pthread_mutex_lock(&fs->open_lock);
+			open->refs++;
+			pthread_mutex_unlock(&fs->open_lock);
+			handle->fs = fs;
+			handle->open = open;
+		}
+	}
+	pthread_rwlock_unlock(inode_lock(fs, inumber));
+	fs_unlock(fs);
+
+	return handle;
+}
+
+int fs_close( struct fs_handle *handle ) {
+	if (!handle) {
+		return 0;
+	}
+	struct fs *fs = handle->fs;
+	struct open_inode *open = handle->open;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_wrlock(inode_lock(fs, open->inumber));
+	if (!open->dead) {
+		file_sync(fs, &open->file);
+	}
+	pthread_mutex_lock(&fs->open_lock);
+	int last = --open->refs == 0;
+	if (last && !open->dead) {
+		struct open_inode **slot = open_slot(fs, open->inumber);
+		*slot = open->next;
+	}
+	pthread_mutex_unlock(&fs->open_lock);
+	pthread_rwlock_unlock(inode_lock(fs, open->inumber));
+	fs_unlock(fs);
+
+	if (last) {
+		pthread_mutex_destroy(&open->map_lock);
+		free(open);
+	}
+	free(handle);
+	return 1;
+}
+
+static int handle_valid(struct fs_handle *handle) {
+	if (handle->open->dead) {
+		printf("Error: inode %d was deleted or unmounted while open\n", handle->open->inumber);
+		return 0;
+	}
+	return 1;
+}
+
+int fs_handle_read( struct fs_handle *handle, char *data, int length ) {
+	struct fs *fs = handle->fs;
+	int result = -1;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_rdlock(inode_lock(fs, handle->open->inumber));
+	if (handle_valid(handle)) {
+		result = file_read(fs, &handle->open->file, data, length, handle->position);
+		if (result > 0) {
+			handle->position += result;
+		}
+	}
+	pthread_rwlock_unlock(inode_lock(fs, handle->open->inumber));
+	fs_unlock(fs);
+
+	return result;
+}
+
+int fs_handle_write( struct fs_handle *handle, const char *data, int length ) {
+	struct fs *fs = handle->fs;
+	int result = -1;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_wrlock(inode_lock(fs, handle->open->inumber));
+	if (handle_valid(handle)) {
+		result = file_write(fs, &handle->open->file, data, length, handle->position);
+		handle->position += result;
+	}
+	pthread_rwlock_unlock(inode_lock(fs, handle->open->inumber));
+	fs_unlock(fs);
+
+	return result;
+}
+
+int64_t fs_seek( struct fs_handle *handle, int64_t offset, int whence ) {
+	struct fs *fs = handle->fs;
+	int64_t position = -1;
+
+	fs_lock_shared(fs);
+	pthread_rwlock_rdlock(inode_lock(fs, handle->open->inumber));
+	if (handle_valid(handle)) {
+		if (whence == FS_SEEK_SET) {
+			position = offset;
+		} else if (whence == FS_SEEK_CUR) {
+			position = handle->position + offset;
+		} else if (whence == FS_SEEK_END) {
+			position = handle->open->file.inode.size + offset;
+		}
+		if (position < 0) {
+			printf("Error: invalid seek\n");
+			position = -1;
+		} else {
+			handle->position = position;
+		}
+	}
+	pthread_rwlock_unlock(inode_lock(fs, handle->open->inumber));
+	fs_unlock(fs);
+
+	return position;
+}
+
+// moving data between a host file and an inode: runs of whole blocks go
+// straight between the host file and the image without coming through
+// memory, and only partial blocks, holes, hosts that are not regular files
+// and filesystems that must see the data (dedup, checksums) are copied
+
+#define COPY_RUN    256
+#define COPY_BLOCKS 16
+#define COPY_SLICE  ((int64_t)16 << 20)
+
+// the host file's position, if it is a regular file the disk can copy to,
+// and how much of it is left from there
+static int host_position(int fd, int64_t *position, int64_t *remaining) {
+	struct stat info;
+	*position = -1;
+	*remaining = INT64_MAX;
+	if (fstat(fd, &info) < 0 || !S_ISREG(info.st_mode)) {
+		return 0;
+	}
+	*position = lseek(fd, 0, SEEK_CUR);
+	if (*position < 0) {
+		return 0;
+	}
+	*remaining = info.st_size > *position ? info.st_size - *position : 0;
+	return 1;
+}
+
+// a position of -1 reads or writes at the descriptor's own position
+static int host_read(int fd, char *data, int length, int64_t position) {
+	int done = 0;
+	while (done < length) {
+		ssize_t result = position < 0 ? read(fd, data + done, length - done) : pread(fd, data + done, length - done, position + done);
+		if (result < 0 && errno == EINTR) continue;
+		if (result < 0) {
+			printf("Error: cannot read host file: %s\n", strerror(errno));
+			return done ? done : -1;
+		}
+		if (result == 0) break;
+		done += result;
+	}
+	return done;
+}
+
+static int host_write(int fd, const char *data, int length, int64_t position) {
+	int done = 0;
+	while (done < length) {
+		ssize_t result = position < 0 ? write(fd, data + done, length - done) : pwrite(fd, data + done, length - done, position + done);
+		if (result < 0 && errno == EINTR) continue;
+		if (result <= 0) {
+			printf("Error: cannot write host file: %s\n", strerror(errno));
+			break;
+		}
+		done += result;
+	}
+	return done;
+}
+
+// copy a run of whole blocks in from the host file, then point the file at
+// the ones that arrived and give back the rest; returns how many arrived
+static int copyin_run(struct fs *fs, struct fs_file *file, int fd, int64_t position, int64_t lblock, int start, int count, const int *olds) {
+	int64_t moved = disk_ctx_copy_in(fs->disk, start, count, fd, position);
+	int arrived = moved / DISK_BLOCK_SIZE;
+
+	for (int i = 0; i < count; i++) {
+		int target = start + i;
+		if (target == olds[i]) {
+			continue;
+		}
+		if (i < arrived && file_set_block(fs, file, lblock + i, target)) {
+			block_release(fs, olds[i]);
+		} else {
+			block_release(fs, target);
+			if (i < arrived) arrived = i;
+		}
+	}
+	return arrived;
+}
+
+static int64_t file_copyin(struct fs *fs, struct fs_file *file, int fd, int64_t length, int64_t offset) {
+	union fs_block buffer[COPY_BLOCKS];
+	int olds[COPY_RUN];
+	int64_t position, remaining;
+	int direct = host_position(fd, &position, &remaining) && !fs->dedup_index && !checksums_enabled(fs);
+	int64_t done = 0;
+
+	// runs stop at the end of the host file rather than copying into a
+	// block that the buffer would have to fill in again
+	if (length > remaining) {
+		length = remaining;
+	}
+	if (offset < 0 || length <= 0) {
+		return 0;
+	}
+
+	while (done < length) {
+		int64_t pos = offset + done;
+		int64_t lblock = pos / DISK_BLOCK_SIZE;
+
+		if (direct && pos % DISK_BLOCK_SIZE == 0 && length - done >= DISK_BLOCK_SIZE) {
+			// blocks are overwritten in place unless shared, as block_store does,
+			// and the run ends where the disk blocks stop being consecutive
+			int start = 0, count = 0;
+			while (count < COPY_RUN && length - done - (int64_t)count * DISK_BLOCK_SIZE >= DISK_BLOCK_SIZE && lblock + count < file_max_blocks(fs)) {
+				int old = file_get_block(fs, file, lblock + count);
+				if (old < 0) break;
+				int target = old;
+				if (!old || block_refs(fs, old) > 1) {
+					target = block_alloc(fs, file->inumber);
+					if (!target) break;
+				}
+				if (count && target != start + count) {
+					if (target != old) block_release(fs, target);
+					break;
+				}
+				if (!count) start = target;
+				olds[count++] = old;
+			}
+			if (!count) {
+				break;
+			}
+			int arrived = copyin_run(fs, file, fd, position + done, lblock, start, count, olds);
+			done += (int64_t)arrived * DISK_BLOCK_SIZE;
+			if (arrived < count) {
+				// the host file ended inside the run, or the copy failed;
+				// whatever is left goes through the buffer
+				direct = 0;
+			}
+			continue;
+		}
+
+		if (lblock >= file_max_blocks(fs)) {
+			break;
+		}
+		// up to the next block boundary only, so the blocks after it can go direct
+		int n = direct ? DISK_BLOCK_SIZE - pos % DISK_BLOCK_SIZE : (int)sizeof(buffer);
+		if (n > length - done) n = length - done;
+		int got = host_read(fd, buffer[0].data, n, position < 0 ? -1 : position + done);
+		if (got <= 0) {
+			break;
+		}
+		int wrote = file_write(fs, file, buffer[0].data, got, pos);
+		done += wrote;
+		if (wrote < got || got < n) {
+			break;
+		}
+	}
+
+	if (offset + done > file->inode.size) {
+		file->inode.size = offset + done;
+		file->inode_dirty = 1;
+	}
+	if (file->writeback) {
+		info_flush(fs);
+	} else {
+		file_sync(fs, file);
+	}
+	if (position >= 0) {
+		lseek(fd, position + done, SEEK_SET);
+	}
+	return done;
+}
+
+static int64_t file_copyout(struct fs *fs, struct fs_file *file, int fd, int64_t length, int64_t offset) {
+	union fs_block buffer[COPY_BLOCKS];
+	int64_t position, remaining;
+	int direct = host_position(fd, &position, &remaining) && !checksums_enabled(fs);
+	int64_t done = 0;
+
+	if (offset < 0 || offset >= file->inode.size || length <= 0) {
+		return 0;
+	}
+	if (length > file->inode.size - offset) {
+		length = file->inode.size - offset;
+	}
+
+	while (done < length) {
+		int64_t pos = offset + done;
+		int64_t lblock = pos / DISK_BLOCK_SIZE;
+
+		int start = 0;
+		if (direct && pos % DISK_BLOCK_SIZE == 0 && length - done >= DISK_BLOCK_SIZE) {
+			start = file_get_block(fs, file, lblock);
+		}
+		if (start < 0) {
+			break;
+		}
+		if (start) {
+			int count = 1;
+			while (count < COPY_RUN && length - done - (int64_t)count * DISK_BLOCK_SIZE >= DISK_BLOCK_SIZE && file_get_block(fs, file, lblock + count) == start + count) {
+				count++;
+			}
+			int64_t moved = disk_ctx_copy_out(fs->disk, start, count, fd, position + done);
+			done += moved;
+			if (moved < (int64_t)count * DISK_BLOCK_SIZE) {
+				break;
+			}
+			continue;
+		}
+
+		// holes and partial blocks, one block at a time while the rest can go direct
+		int n = direct ? DISK_BLOCK_SIZE - pos % DISK_BLOCK_SIZE : (int)sizeof(buffer);
+		if (n > length - done) n = length - done;
+		int got = file_read(fs, file, buffer[0].data, n, pos);
+		if (got <= 0) {
+			break;
+		}
+		int put = host_write(fd, buffer[0].data, got, position < 0 ? -1 : position + done);
+		done += put;
+		if (put < got) {
+			break;
+		}
+	}
+
+	if (position >= 0) {
+		lseek(fd, position + done, SEEK_SET);
+	}
+	return done;
+}
+
+// the inode lock is let go every COPY_SLICE bytes so a long copy doesn't
+// shut out everyone else using the inode
+int64_t fs_handle_copyin( struct fs_handle *handle, int fd, int64_t length ) {
+	struct fs *fs = handle->fs;
+	int64_t total = 0;
+
+	while (total < length) {
+		int64_t slice = length - total < COPY_SLICE ? length - total : COPY_SLICE;
+		int64_t moved = -1;
+
+		fs_lock_shared(fs);
+		pthread_rwlock_wrlock(inode_lock(fs, handle->open->inumber));
+		if (handle_valid(handle)) {
+			moved = file_copyin(fs, &handle->open->file, fd, slice, handle->position);
+			handle->position += moved;
+		}
+		pthread_rwlock_unlock(inode_lock(fs, handle->open->inumber));
+		fs_unlock(fs);
+
+		if (moved < 0) {
+			return total ? total : -1;
+		}
+		total += moved;
+		if (moved < slice) {
+			break;
+		}
+	}
+	return total;
+}
+
+int64_t fs_handle_copyout( struct fs_handle *handle, int fd, int64_t length ) {
+	struct fs *fs = handle->fs;
+	int64_t total = 0;
+
+	while (total < length) {
+		int64_t slice = length - total < COPY_SLICE ? length - total : COPY_SLICE;
+		int64_t moved = -1;
+
+		fs_lock_shared(fs);
+		pthread_rwlock_rdlock(inode_lock(fs, handle->open->inumber));
+		if (handle_valid(handle)) {
+			moved = file_copyout(fs, &handle->open->file, fd, slice, handle->position);
+			handle->position += moved;
+		}
+		pthread_rwlock_unlock(inode_lock(fs, handle->open->inumber));
+		fs_unlock(fs);
+
+		if (moved < 0) {
+			return total ? total : -1;
+		}
+		total += moved;
+		if (moved < slice) {
+			break;
+		}
+	}
+	return total;
+}
+
+// snapshots: the inode table is copied, every block it references gains a
+// reference, and later writes copy a block before changing it while it is shared
+
+static int snapshots_enabled(struct fs *fs) {
+	if (!fs->is_mounted) {
+		printf("Error: filesystem is not mounted\n");
+		return 0;
+	}
+	if (!(fs->super.features & FS_FEATURE_SNAPSHOTS)) {
+		printf("Error: filesystem was not formatted with snapshots\n");
+		return 0;
+	}
+	return 1;
+}
+
+// the slot holding snapid, -1 if there is none, or -2 if the table fails its checksum
+static int snapshot_find(struct fs *fs, union fs_block *table, int snapid) {
+	if (!block_read(fs, fs->super.snaptable, table->data)) {
+		return -2;
+	}
+	for (int i = 0; i < (int)SNAPSHOTS_PER_BLOCK; i++) {
+		if (table->snapshot[i].isvalid && table->snapshot[i].id == snapid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// release the inode table copies in a map chain and everything they
+// reference; with release clear nothing changes and the chain is only
+// checked, which returns 0 if any block in it fails its checksum
+static int snapshot_walk(struct fs *fs, int mapblock, int release) {
+	union fs_block map;
+	union fs_block iblock;
+
+	while (mapblock) {
+		if (!block_read(fs, mapblock, map.data)) {
+			return 0;
+		}
+		for (int i = 0; i < MAP_ENTRIES_PER_BLOCK; i++) {
+			if (!map.pointers[i]) {
+				continue;
+			}
+			if (!block_read(fs, map.pointers[i], iblock.data)) {
+				return 0;
+			}
+			for (int k = 0; k < INODES_PER_BLOCK; k++) {
+				struct fs_inode inode;
+				inode_decode(fs, &iblock, k, &inode);
+				if (inode.isvalid && !release && !inode_verify(fs, &inode)) {
+					return 0;
+				}
+				if (inode.isvalid && release) {
+					inode_release_blocks(fs, &inode);
+				}
+			}
+			if (release) block_release(fs, map.pointers[i]);
+		}
+		int next = map.pointers[MAP_ENTRIES_PER_BLOCK];
+		if (release) block_release(fs, mapblock);
+		mapblock = next;
+	}
+	return 1;
+}
+
+static int snapshot_create_locked(struct fs *fs) {
+	union fs_block table;
+	union fs_block map;
+	union fs_block iblock;
+
+	if (!snapshots_enabled(fs)) {
+		return 0;
+	}
+
+	// the copy is taken from the inode table on disk
+	open_flush_all(fs);
+
+	if (!block_read(fs, fs->super.snaptable, table.data)) {
+		return 0;
+	}
+	int slot = -1, id = 1;
+	for (int i = 0; i < (int)SNAPSHOTS_PER_BLOCK; i++) {
+		if (table.snapshot[i].isvalid) {
+			if (table.snapshot[i].id >= id) id = table.snapshot[i].id + 1;
+		} else if (slot < 0) {
+			slot = i;
+		}
+	}
+	if (slot < 0) {
+		printf("Error: snapshot table is full\n");
+		return 0;
+	}
+
+	struct fs_snapshot snap = {0};
+	snap.id = id;
+	snap.created = time(0);
+	snap.mapblock = block_alloc(fs, 0);
+	if (!snap.mapblock) {
+		return 0;
+	}
+
+	int mapblock = snap.mapblock;
+	int failed = 0;
+	memset(map.data, 0, DISK_BLOCK_SIZE);
+	for (int i = 0; i < fs->super.ninodeblocks && !failed; i++) {
+		int entry = i % MAP_ENTRIES_PER_BLOCK;
+		if (i > 0 && entry == 0) {
+			int next = block_alloc(fs, 0);
+			if (!next) {
+				failed = 1;
+				break;
+			}
+			map.pointers[MAP_ENTRIES_PER_BLOCK] = next;
+			block_write(fs, mapblock, map.data);
+			memset(map.data, 0, DISK_BLOCK_SIZE);
+			mapblock = next;
+		}
+
+		// inode blocks with nothing in them are not worth a copy
+		if (!block_read(fs, 1 + i, iblock.data)) {
+			failed = 2;
+			break;
+		}
+		int nvalid = 0;
+		for (int k = 0; k < INODES_PER_BLOCK; k++) {
+			struct fs_inode inode;
+			inode_decode(fs, &iblock, k, &inode);
+			if (!inode.isvalid) {
+				continue;
+			}
+			if (!inode_verify(fs, &inode)) {
+				failed = 2;
+				break;
+			}
+			nvalid++;
+		}
+		if (failed) {
+			break;
+		}
+		if (!nvalid) {
+			continue;
+		}
+
+		int copy = block_alloc(fs, i);
+		if (!copy) {
+			failed = 1;
+			break;
+		}
+		block_write(fs, copy, iblock.data);
+		map.pointers[entry] = copy;
+		for (int k = 0; k < INODES_PER_BLOCK; k++) {
+			struct fs_inode inode;
+			inode_decode(fs, &iblock, k, &inode);
+			if (inode.isvalid) {
+				inode_ref_blocks(fs, &inode);
+			}
+		}
+		snap.nfiles += nvalid;
+	}
+	block_write(fs, mapblock, map.data);
+
+	if (failed) {
+		if (failed == 1) printf("Error: not enough free blocks for snapshot\n");
+		snapshot_walk(fs, snap.mapblock, 1);
+		info_flush(fs);
+		return 0;
+	}
+
+	snap.isvalid = 1;
+	table.snapshot[slot] = snap;
+	block_write(fs, fs->super.snaptable, table.data);
+	info_flush(fs);
+
+	return id;
+}
+
+int fs_ctx_snapshot_create( struct fs *fs ) {
+	fs_lock_exclusive(fs);
+	int result = snapshot_create_locked(fs);
+	fs_unlock(fs);
+	return result;
+}
+
+static int snapshot_delete_locked(struct fs *fs, int snapid) {
+	union fs_block table;
+
+	if (!snapshots_enabled(fs)) {
+		return 0;
+	}
+
+	int slot = snapshot_find(fs, &table, snapid);
+	if (slot < 0) {
+		if (slot == -1) printf("Error: no snapshot %d\n", snapid);
+		return 0;
+	}
+
+	if (checksums_enabled(fs) && !snapshot_walk(fs, table.snapshot[slot].mapblock, 0)) {
+		return 0;
+	}
+	snapshot_walk(fs, table.snapshot[slot].mapblock, 1);
+	memset(&table.snapshot[slot], 0, sizeof(table.snapshot[slot]));
+	block_write(fs, fs->super.snaptable, table.data);
+	info_flush(fs);
+
+	return 1;
+}
+
+int fs_ctx_snapshot_delete( struct fs *fs, int snapid ) {
+	fs_lock_exclusive(fs);
+	int result = snapshot_delete_locked(fs, snapid);
+	fs_unlock(fs);
+	return result;
+}
+
+static int snapshot_list_locked(struct fs *fs) {
+	union fs_block table;
+	int count = 0;
+
+	if (!snapshots_enabled(fs)) {
+		return -1;
+	}
+
+	if (!block_read(fs, fs->super.snaptable, table.data)) {
+		return -1;
+	}
+	for (int i = 0; i < (int)SNAPSHOTS_PER_BLOCK; i++) {
+		if (table.snapshot[i].isvalid) {
+			char when[64];
+			time_t created = table.snapshot[i].created;
+			struct tm tm;
+			strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&created, &tm));
+			printf("snapshot %d: %d files, created %s\n", table.snapshot[i].id, table.snapshot[i].nfiles, when);
+			count++;
+		}
+	}
+	return count;
+}
+
+int fs_ctx_snapshot_list( struct fs *fs ) {
+	fs_lock_shared(fs);
+	int result = snapshot_list_locked(fs);
+	fs_unlock(fs);
+	return result;
+}
+
+static int file_load_snapshot(struct fs *fs, struct fs_file *file, int snapid, int inumber) {
+	union fs_block table;
+	union fs_block block;
+
+	if (!snapshots_enabled(fs)) {
+		return 0;
+	}
+	if (!inumber_in_range(fs, inumber)) {
+		printf("Error: inode number is out of bounds.\n");
+		return 0;
+	}
+
+	int slot = snapshot_find(fs, &table, snapid);
+	if (slot < 0) {
+		if (slot == -1) printf("Error: no snapshot %d\n", snapid);
+		return 0;
+	}
+
+	// follow the map chain to the copy of this inode's block
+	int index = get_block_num(inumber) - 1;
+	int mapblock = table.snapshot[slot].mapblock;
+	if (!block_read(fs, mapblock, block.data)) {
+		return 0;
+	}
+	while (index >= MAP_ENTRIES_PER_BLOCK) {
+		if (!block_read(fs, block.pointers[MAP_ENTRIES_PER_BLOCK], block.data)) {
+			return 0;
+		}
+		index -= MAP_ENTRIES_PER_BLOCK;
+	}
+
+	file_init(file, inumber);
+	if (block.pointers[index]) {
+		if (!block_read(fs, block.pointers[index], block.data)) {
+			return 0;
+		}
+		inode_decode(fs, &block, inumber % INODES_PER_BLOCK, &file->inode);
+	}
+
+	if (!file->inode.isvalid) {
+		printf("Error: Invalid inode\n");
+		return 0;
+	}
+	return 1;
+}
+
+int fs_ctx_snapshot_read( struct fs *fs, int snapid, int inumber, char *data, int length, int64_t offset ) {
+	struct fs_file file;
+
+	int result = 0;
+
+	if (snapid == 0) {
+		return fs_ctx_read(fs, inumber, data, length, offset);
+	}
+
+	// snapshot contents never change, so the fs lock alone is enough
+	fs_lock_shared(fs);
+	if (file_load_snapshot(fs, &file, snapid, inumber)) {
+		result = file_read(fs, &file, data, length, offset);
+	}
+	fs_unlock(fs);
+
+	return result;
+}
+
+// directories: a directory is an inode whose file data is an extendible hash
+// index of its entries, so lookups read the header, one table block and one
+// bucket however large the directory grows
+
+static uint32_t name_hash(const char *name) {
+	uint32_t hash = 2166136261u;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// a staged directory reads like a sparse file whose size is its highest block
+static int stage_read(struct fs_stage *stage, int lblock, union fs_block *block) {
+	if (lblock < stage->nblocks && stage->present[lblock]) {
+		*block = stage->blocks[lblock];
+	} else {
+		memset(block->data, 0, DISK_BLOCK_SIZE);
+	}
+	return lblock < stage->nblocks;
+}
+
+static int stage_write(struct fs_stage *stage, int lblock, union fs_block *block) {
+	if (lblock >= stage->capacity) {
+		int capacity = stage->capacity ? stage->capacity : DIR_FIRST_BUCKET + 1;
+		while (capacity <= lblock) capacity *= 2;
+		union fs_block *blocks = realloc(stage->blocks, (size_t)capacity * sizeof(*blocks));
+		if (!blocks) {
+			printf("Error: out of memory\n");
+			return 0;
+		}
+		stage->blocks = blocks;
+		unsigned char *present = realloc(stage->present, capacity);
+		if (!present) {
+			printf("Error: out of memory\n");
+			return 0;
+		}
+		memset(present + stage->capacity, 0, capacity - stage->capacity);
+		stage->present = present;
+		stage->capacity = capacity;
+	}
+	stage->blocks[lblock] = *block;
+	stage->present[lblock] = 1;
+	if (lblock >= stage->nblocks) stage->nblocks = lblock + 1;
+	return 1;
+}
+
+static int dir_read_block(struct fs *fs, struct fs_file *dir, int lblock, union fs_block *block) {
+	if (dir->stage) {
+		return stage_read(dir->stage, lblock, block);
+	}
+	if (file_read(fs, dir, block->data, DISK_BLOCK_SIZE, lblock * DISK_BLOCK_SIZE) != DISK_BLOCK_SIZE) {
+		memset(block->data, 0, DISK_BLOCK_SIZE);
+		return 0;
+	}
+	return 1;
+}
+
+static int dir_write_block(struct fs *fs, struct fs_file *dir, int lblock, union fs_block *block) {
+	if (dir->stage) {
+		return stage_write(dir->stage, lblock, block);
+	}
+	return file_write(fs, dir, block->data, DISK_BLOCK_SIZE, lblock * DISK_BLOCK_SIZE) == DISK_BLOCK_SIZE;
+}
+
+static int dir_read_header(struct fs *fs, struct fs_file *dir, struct fs_dirheader *header) {
+	union fs_block block;
+	if (!dir_read_block(fs, dir, 0, &block) || block.dirheader.magic != DIR_MAGIC) {
+		return 0;
+	}
+	*header = block.dirheader;
+	return 1;
+}
+
+static int dir_write_header(struct fs *fs, struct fs_file *dir, struct fs_dirheader *header) {
+	union fs_block block;
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	block.dirheader = *header;
+	return dir_write_block(fs, dir, 0, &block);
+}
+
+// how many blocks long the directory file is
+static int dir_nblocks(struct fs_file *dir) {
+	if (dir->stage) {
+		return dir->stage->nblocks;
+	}
+	return (dir->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+}
+
+// the bucket that hash lands in, as a block number within the directory file;
+// 0 if the table can't be read or points outside the buckets
+static int dir_bucket_of(struct fs *fs, struct fs_file *dir, struct fs_dirheader *header, uint32_t hash) {
+	union fs_block table;
+
+	if (header->depth > DIR_MAX_DEPTH) {
+		printf("Error: directory inode %d has a bad hash depth\n", dir->inumber);
+		return 0;
+	}
+	int index = hash & ((1u << header->depth) - 1);
+	if (!dir_read_block(fs, dir, 1 + index / POINTERS_PER_BLOCK, &table)) {
+		printf("Error: can't read the hash table of directory inode %d\n", dir->inumber);
+		return 0;
+	}
+	int lblock = table.pointers[index % POINTERS_PER_BLOCK];
+	if (lblock < DIR_FIRST_BUCKET || lblock >= DIR_FIRST_BUCKET + header->nbuckets || lblock >= dir_nblocks(dir)) {
+		printf("Error: directory inode %d points to bad bucket %d\n", dir->inumber, lblock);
+		return 0;
+	}
+	return lblock;
+}
+
+// read the bucket that name lands in; returns its block number, or 0
+static int dir_bucket_read(struct fs *fs, struct fs_file *dir, struct fs_dirheader *header, const char *name, union fs_block *bucket) {
+	int lblock = dir_bucket_of(fs, dir, header, name_hash(name));
+	if (!lblock) {
+		return 0;
+	}
+	if (!dir_read_block(fs, dir, lblock, bucket) || bucket->dirbucket.count < 0 || bucket->dirbucket.count > (int)DIRENTS_PER_BUCKET) {
+		printf("Error: can't read bucket %d of directory inode %d\n", lblock, dir->inumber);
+		return 0;
+	}
+	return lblock;
+}
+
+// the inode that name maps to, 0 if there is none, or -1 if the
+// directory can't be read
+static int dir_lookup(struct fs *fs, struct fs_file *dir, const char *name) {
+	struct fs_dirheader header;
+	union fs_block bucket;
+
+	if (!dir_read_header(fs, dir, &header)) {
+		return 0;
+	}
+	if (!dir_bucket_read(fs, dir, &header, name, &bucket)) {
+		return -1;
+	}
+	for (int i = 0; i < bucket.dirbucket.count; i++) {
+		if (!strcmp(bucket.dirbucket.entry[i].name, name)) {
+			return bucket.dirbucket.entry[i].inumber;
+		}
+	}
+	return 0;
+}
+
+// split a full bucket in two, doubling the table first if the bucket
+// already uses every bit of it
+static int dir_split(struct fs *fs, struct fs_file *dir, struct fs_dirheader *header, int lblock, union fs_block *bucket, uint32_t hash) {
+	union fs_block table;
+
+	if (bucket->dirbucket.depth == header->depth) {
+		if (header->depth == DIR_MAX_DEPTH) {
+			printf("Error: directory is full\n");
+			return 0;
+		}
+		// the new upper half of the table mirrors the lower half
+		int n = 1 << header->depth;
+		if (n < POINTERS_PER_BLOCK) {
+			if (!dir_read_block(fs, dir, 1, &table)) return 0;
+			memcpy(&table.pointers[n], &table.pointers[0], n * sizeof(int));
+			if (!dir_write_block(fs, dir, 1, &table)) return 0;
+		} else {
+			for (int t = 0; t < n / POINTERS_PER_BLOCK; t++) {
+				if (!dir_read_block(fs, dir, 1 + t, &table)) return 0;
+				if (!dir_write_block(fs, dir, 1 + t + n / POINTERS_PER_BLOCK, &table)) return 0;
+			}
+		}
+		header->depth++;
+	}
+
+	int newblock = DIR_FIRST_BUCKET + header->nbuckets;
+	if (newblock >= file_max_blocks(fs)) {
+		printf("Error: directory is full\n");
+		return 0;
+	}
+
+	// entries with the next hash bit set move to the new bucket
+	uint32_t bit = 1u << bucket->dirbucket.depth;
+	union fs_block split;
+	memset(split.data, 0, DISK_BLOCK_SIZE);
+	bucket->dirbucket.depth++;
+	split.dirbucket.depth = bucket->dirbucket.depth;
+
+	int kept = 0;
+	for (int i = 0; i < bucket->dirbucket.count; i++) {
+		struct fs_dirent *entry = &bucket->dirbucket.entry[i];
+		if (name_hash(entry->name) & bit) {
+			split.dirbucket.entry[split.dirbucket.count++] = *entry;
+		} else {
+			bucket->dirbucket.entry[kept++] = *entry;
+		}
+	}
+	bucket->dirbucket.count = kept;
+
+	if (!dir_write_block(fs, dir, newblock, &split) || !dir_write_block(fs, dir, lblock, bucket)) {
+		return 0;
+	}
+	header->nbuckets++;
+
+	// repoint every table slot of the old bucket that has the bit set
+	int loaded = -1;
+	int nslots = 1 << header->depth;
+	for (int i = (hash & (bit - 1)) | bit; i < nslots; i += bit << 1) {
+		int t = 1 + i / POINTERS_PER_BLOCK;
+		if (t != loaded) {
+			if (loaded >= 0 && !dir_write_block(fs, dir, loaded, &table)) return 0;
+			if (!dir_read_block(fs, dir, t, &table)) return 0;
+			loaded = t;
+		}
+		table.pointers[i % POINTERS_PER_BLOCK] = newblock;
+	}
+	if (loaded >= 0 && !dir_write_block(fs, dir, loaded, &table)) {
+		return 0;
+	}
+
+	return dir_write_header(fs, dir, header);
+}
+
+static int dir_add(struct fs *fs, struct fs_file *dir, const char *name, int inumber) {
+	struct fs_dirheader header;
+	union fs_block block;
+
+	if (!dir_read_header(fs, dir, &header)) {
+		// first entry: one empty bucket that every hash maps to
+		memset(&header, 0, sizeof(header));
+		header.magic = DIR_MAGIC;
+		header.nbuckets = 1;
+		memset(block.data, 0, DISK_BLOCK_SIZE);
+		if (!dir_write_block(fs, dir, DIR_FIRST_BUCKET, &block)) return 0;
+		block.pointers[0] = DIR_FIRST_BUCKET;
+		if (!dir_write_block(fs, dir, 1, &block)) return 0;
+	}
+
+	uint32_t hash = name_hash(name);
+	while (1) {
+		int lblock = dir_bucket_read(fs, dir, &header, name, &block);
+		if (!lblock) {
+			return 0;
+		}
+
+		for (int i = 0; i < block.dirbucket.count; i++) {
+			if (!strcmp(block.dirbucket.entry[i].name, name)) {
+				printf("Error: %s already exists\n", name);
+				return 0;
+			}
+		}
+
+		if (block.dirbucket.count < (int)DIRENTS_PER_BUCKET) {
+			struct fs_dirent *entry = &block.dirbucket.entry[block.dirbucket.count++];
+			memset(entry, 0, sizeof(*entry));
+			entry->inumber = inumber;
+			strcpy(entry->name, name);
+			if (!dir_write_block(fs, dir, lblock, &block)) return 0;
+			header.nentries++;
+			return dir_write_header(fs, dir, &header);
+		}
+
+		if (!dir_split(fs, dir, &header, lblock, &block, hash)) {
+			return 0;
+		}
+	}
+}
+
+static int dir_remove(struct fs *fs, struct fs_file *dir, const char *name) {
+	struct fs_dirheader header;
+	union fs_block bucket;
+
+	if (!dir_read_header(fs, dir, &header)) {
+		return 0;
+	}
+	int lblock = dir_bucket_read(fs, dir, &header, name, &bucket);
+	if (!lblock) {
+		return 0;
+	}
+	for (int i = 0; i < bucket.dirbucket.count; i++) {
+		if (!strcmp(bucket.dirbucket.entry[i].name, name)) {
+			int inumber = bucket.dirbucket.entry[i].inumber;
+			bucket.dirbucket.entry[i] = bucket.dirbucket.entry[--bucket.dirbucket.count];
+			memset(&bucket.dirbucket.entry[bucket.dirbucket.count], 0, sizeof(struct fs_dirent));
+			if (!dir_write_block(fs, dir, lblock, &bucket)) {
+				return 0;
+			}
+			header.nentries--;
+			dir_write_header(fs, dir, &header);
+			return inumber;
+		}
+	}
+	return 0;
+}
+
+static int dir_count(struct fs *fs, struct fs_file *dir) {
+	struct fs_dirheader header;
+	return dir_read_header(fs, dir, &header) ? header.nentries : 0;
+}
+
+// gather every entry of a directory into *entries, which the caller frees;
+// returns how many there are, or -1 if a bucket can't be read
+static int dir_entries(struct fs *fs, struct fs_file *dir, struct fs_dirent **entries) {
+	struct fs_dirheader header;
+	union fs_block bucket;
+	int count = 0;
+
+	*entries = 0;
+	if (!dir_read_header(fs, dir, &header) || header.nentries <= 0) {
+		return 0;
+	}
+	*entries = malloc(header.nentries * sizeof(**entries));
+	for (int b = 0; *entries && b < header.nbuckets; b++) {
+		if (!dir_read_block(fs, dir, DIR_FIRST_BUCKET + b, &bucket)) {
+			free(*entries);
+			*entries = 0;
+			return -1;
+		}
+		for (int i = 0; i < bucket.dirbucket.count && count < header.nentries; i++) {
+			(*entries)[count++] = bucket.dirbucket.entry[i];
+		}
+	}
+	return count;
+}
+
+// check that every slot of a directory's hash table points at a bucket,
+// reading each table block once; returns 0 if one doesn't
+static int dir_check_table(struct fs *fs, struct fs_file *dir) {
+	struct fs_dirheader header;
+	union fs_block table;
+
+	if (!dir_read_header(fs, dir, &header)) {
+		return 1;
+	}
+	if (header.depth > DIR_MAX_DEPTH) {
+		printf("Error: directory inode %d has a bad hash depth\n", dir->inumber);
+		return 0;
+	}
+	int nslots = 1 << header.depth;
+	int end = DIR_FIRST_BUCKET + header.nbuckets;
+	if (end > dir_nblocks(dir)) end = dir_nblocks(dir);
+	for (int i = 0; i < nslots; i++) {
+		if (i % POINTERS_PER_BLOCK == 0 && !dir_read_block(fs, dir, 1 + i / POINTERS_PER_BLOCK, &table)) {
+			printf("Error: can't read the hash table of directory inode %d\n", dir->inumber);
+			return 0;
+		}
+		int lblock = table.pointers[i % POINTERS_PER_BLOCK];
+		if (lblock < DIR_FIRST_BUCKET || lblock >= end) {
+			printf("Error: directory inode %d points to bad bucket %d\n", dir->inumber, lblock);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// visit every entry of every directory and add up what visit returns, for
+// fsck; returns -1 if some directory could not be read. callers hold the fs
+// lock exclusively, which stands in for the inode locks
+static int dir_walk_all(struct fs *fs, int (*visit)(struct fs *, struct fs_file *, struct fs_dirent *, void *), void *arg) {
+	union fs_block block;
+	int total = 0, failed = 0;
+
+	for (int i = 1; i <= fs->super.ninodeblocks; i++) {
+		if (!block_read(fs, i, block.data)) {
+			failed = 1;
+			continue;
+		}
+		for (int k = 0; k < INODES_PER_BLOCK; k++) {
+			struct fs_inode inode;
+			struct fs_file file, *dir;
+			struct fs_dirent *entries;
+
+			inode_decode(fs, &block, k, &inode);
+			if (inode.isvalid != INODE_DIR) {
+				continue;
+			}
+			int count = -1;
+			if ((dir = file_get(fs, &file, (i - 1) * INODES_PER_BLOCK + k)) && dir_check_table(fs, dir)) {
+				count = dir_entries(fs, dir, &entries);
+			}
+			if (count < 0) {
+				failed = 1;
+				continue;
+			}
+			for (int e = 0; e < count; e++) {
+				total += visit(fs, dir, &entries[e], arg);
+			}
+			free(entries);
+		}
+	}
+	return failed ? -1 : total;
+}
+
+static int dir_load(struct fs *fs, struct fs_file *dir, int inumber) {
+	if (!file_load(fs, dir, inumber)) {
+		return 0;
+	}
+	if (dir->inode.isvalid != INODE_DIR) {
+		printf("Error: inode %d is not a directory\n", inumber);
+		return 0;
+	}
+	return 1;
+}
+
+static int lookup_in(struct fs *fs, int dirnum, const char *name) {
+	struct fs_file dir;
+	int inumber = 0;
+
+	pthread_rwlock_rdlock(inode_lock(fs, dirnum));
+	if (dir_load(fs, &dir, dirnum)) {
+		inumber = dir_lookup(fs, &dir, name);
+	}
+	pthread_rwlock_unlock(inode_lock(fs, dirnum));
+	return inumber > 0 ? inumber : 0;
+}
+
+// walk a slash separated path from the root; with name set, stop at the
+// parent directory and copy the last component into name
+static int path_walk(struct fs *fs, const char *path, char *name) {
+	char component[FS_NAME_MAX + 1];
+	int inumber = ROOT_INUMBER;
+
+	if (!fs->is_mounted || !(fs->super.features & FS_FEATURE_DIRS)) {
+		printf("Error: filesystem was not formatted with directories\n");
+		return 0;
+	}
+
+	while (*path) {
+		while (*path == '/') path++;
+		if (!*path) break;
+
+		int len = strcspn(path, "/");
+		if (len > FS_NAME_MAX) {
+			printf("Error: name too long: %.*s\n", len, path);
+			return 0;
+		}
+		memcpy(component, path, len);
+		component[len] = 0;
+		path += len;
+		while (*path == '/') path++;
+
+		if (name && !*path) {
+			strcpy(name, component);
+			return inumber;
+		}
+		if (!strcmp(component, ".")) {
+			continue;
+		}
+
+		inumber = lookup_in(fs, inumber, component);
+		if (!inumber) {
+			return 0;
+		}
+	}
+
+	if (name) {
+		printf("Error: path names no entry\n");
+		return 0;
+	}
+	return inumber;
+}
+
+int fs_ctx_lookup( struct fs *fs, const char *path ) {
+	fs_lock_shared(fs);
+	int inumber = path_walk(fs, path, 0);
+	fs_unlock(fs);
+	return inumber;
+}
+
+static int create_in(struct fs *fs, const char *path, int type) {
+	char name[FS_NAME_MAX + 1];
+	struct fs_file dir;
+	int inumber = 0;
+
+	int dirnum = path_walk(fs, path, name);
+	if (!dirnum) {
+		return 0;
+	}
+
+	pthread_rwlock_wrlock(inode_lock(fs, dirnum));
+	if (dir_load(fs, &dir, dirnum)) {
+		int existing = dir_lookup(fs, &dir, name);
+		if (existing > 0) {
+			printf("Error: %s already exists\n", path);
+		} else if (existing == 0) {
+			inumber = inode_create(fs, type, 1);
+			if (inumber && !dir_add(fs, &dir, name, inumber)) {
+				struct fs_inode empty = {0};
+				inode_save(fs, inumber, &empty);
+				inumber = 0;
+			}
+		}
+	}
+	pthread_rwlock_unlock(inode_lock(fs, dirnum));
+
+	return inumber;
+}
+
+int fs_ctx_create_path( struct fs *fs, const char *path ) {
+	fs_lock_shared(fs);
+	int inumber = create_in(fs, path, INODE_FILE);
+	fs_unlock(fs);
+	return inumber;
+}
+
+int fs_ctx_mkdir( struct fs *fs, const char *path ) {
+	fs_lock_shared(fs);
+	int inumber = create_in(fs, path, INODE_DIR);
+	fs_unlock(fs);
+	return inumber;
+}
+
+// take two inode locks in stripe order so that no pair of callers can deadlock
+static void lock_pair(struct fs *fs, int a, int b) {
+	pthread_rwlock_t *first = inode_lock(fs, a), *second = inode_lock(fs, b);
+	if (first > second) {
+		pthread_rwlock_t *tmp = first;
+		first = second;
+		second = tmp;
+	}
+	pthread_rwlock_wrlock(first);
+	if (second != first) pthread_rwlock_wrlock(second);
+}
+
+static void unlock_pair(struct fs *fs, int a, int b) {
+	pthread_rwlock_unlock(inode_lock(fs, a));
+	if (inode_lock(fs, b) != inode_lock(fs, a)) pthread_rwlock_unlock(inode_lock(fs, b));
+}
+
+static int unlink_in(struct fs *fs, const char *path) {
+	char name[FS_NAME_MAX + 1];
+	struct fs_file dir, file, *f;
+	int result = 0;
+
+	int dirnum = path_walk(fs, path, name);
+	if (!dirnum) {
+		return 0;
+	}
+	int inumber = lookup_in(fs, dirnum, name);
+	if (!inumber) {
+		printf("Error: %s not found\n", path);
+		return 0;
+	}
+
+	lock_pair(fs, dirnum, inumber);
+	if (dir_load(fs, &dir, dirnum) && dir_lookup(fs, &dir, name) == inumber && (f = file_get(fs, &file, inumber))) {
+		if (f->inode.isvalid == INODE_DIR && dir_count(fs, f) > 0) {
+			printf("Error: directory %s is not empty\n", path);
+		} else if (inode_verify(fs, &f->inode)) {
+			if (dir_remove(fs, &dir, name) == inumber) {
+				result = file_delete(fs, f);
+			}
+		}
+	}
+	unlock_pair(fs, dirnum, inumber);
+
+	return result;
+}
+
+int fs_ctx_unlink( struct fs *fs, const char *path ) {
+	fs_lock_shared(fs);
+	int result = unlink_in(fs, path);
+	fs_unlock(fs);
+	return result;
+}
+
+static int list_in(struct fs *fs, const char *path) {
+	struct fs_file dir;
+	struct fs_inode inode;
+	struct fs_dirent *entries = 0;
+	int count = -1;
+
+	int dirnum = path_walk(fs, path, 0);
+	if (!dirnum) {
+		return -1;
+	}
+
+	// gather the entries first, since each one is looked at under its own lock
+	pthread_rwlock_rdlock(inode_lock(fs, dirnum));
+	if (dir_load(fs, &dir, dirnum)) {
+		count = dir_entries(fs, &dir, &entries);
+	}
+	pthread_rwlock_unlock(inode_lock(fs, dirnum));
+
+	for (int i = 0; i < count; i++) {
+		pthread_rwlock_rdlock(inode_lock(fs, entries[i].inumber));
+		inode_get(fs, entries[i].inumber, &inode);
+		pthread_rwlock_unlock(inode_lock(fs, entries[i].inumber));
+		if (inode.isvalid == INODE_DIR) {
+			char label[FS_NAME_MAX + 2];
+			snprintf(label, sizeof(label), "%s/", entries[i].name);
+			printf("%-*s inode %d\n", FS_NAME_MAX + 1, label, entries[i].inumber);
+		} else {
+			printf("%-*s inode %d, %lld bytes\n", FS_NAME_MAX + 1, entries[i].name, entries[i].inumber, (long long)inode.size);
+		}
+	}
+	free(entries);
+
+	return count;
+}
+
+int fs_ctx_list( struct fs *fs, const char *path ) {
+	fs_lock_shared(fs);
+	int count = list_in(fs, path);
+	fs_unlock(fs);
+	return count;
+}
+
+// discard: optionally punch freed blocks out of the image file
+
+int fs_ctx_set_discard( struct fs *fs, int enabled ) {
+	fs_lock_exclusive(fs);
+	if (!enabled) {
+		discard_flush(fs);
+	}
+	fs->discard_enabled = enabled;
+	fs_unlock(fs);
+	return 1;
+}
+
+static int trim_locked(struct fs *fs) {
+	int trimmed = 0;
+
+	if (!fs->is_mounted) {
+		printf("Error: filesystem is not mounted\n");
+		return -1;
+	}
+
+	discard_flush(fs);
+	for (int i = fs->data_start, j; i < fs->super.nblocks; i = j) {
+		if (fs->free_block_bitmap[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < fs->super.nblocks && !fs->free_block_bitmap[j]; j++);
+		if (!disk_ctx_discard(fs->disk, i, j - i)) {
+			return -1;
+		}
+		trimmed += j - i;
+	}
+	return trimmed;
+}
+
+int fs_ctx_trim( struct fs *fs ) {
+	fs_lock_exclusive(fs);
+	int trimmed = trim_locked(fs);
+	fs_unlock(fs);
+	return trimmed;
+}
+
+// fsck: verify block checksums and recount every block reference
+
+static int fsck_count(struct fs *fs, uint32_t *refs, int blocknum, const char *what, int owner) {
+	if (blocknum == 0) {
+		return 0;
+	}
+	if (blocknum < fs->data_start || blocknum >= fs->super.nblocks) {
+		printf("inode %d: %s pointer %d is out of range\n", owner, what, blocknum);
+		return 1;
+	}
+	refs[blocknum]++;
+	return 0;
+}
+
+static int fsck_tree(struct fs *fs, uint32_t *refs, int blocknum, int depth, int inumber) {
+	union fs_block map;
+	int problems = 0;
+
+	if (fsck_count(fs, refs, blocknum, depth ? "indirect" : "data", inumber)) {
+		return 1;
+	}
+	if (blocknum && depth > 0) {
+		disk_ctx_read(fs->disk, blocknum, map.data);
+		for (int k = 0; k < POINTERS_PER_BLOCK; k++) {
+			problems += fsck_tree(fs, refs, map.pointers[k], depth - 1, inumber);
+		}
+	}
+	return problems;
+}
+
+static int fsck_inode(struct fs *fs, uint32_t *refs, struct fs_inode *inode, int inumber) {
+	int problems = 0;
+
+	for (int k = 0; k < direct_count(fs); k++) {
+		problems += fsck_count(fs, refs, inode->direct[k], "direct", inumber);
+	}
+	for (int level = 1; level <= indirect_count(fs); level++) {
+		problems += fsck_tree(fs, refs, inode->indirect[level - 1], level, inumber);
+	}
+	return problems;
+}
+
+static int fsck_inode_block(struct fs *fs, uint32_t *refs, union fs_block *iblock, int first_inumber) {
+	int problems = 0;
+	for (int k = 0; k < INODES_PER_BLOCK; k++) {
+		struct fs_inode inode;
+		inode_decode(fs, iblock, k, &inode);
+		if (inode.isvalid) {
+			problems += fsck_inode(fs, refs, &inode, first_inumber + k);
+		}
+	}
+	return problems;
+}
+
+static int fsck_dirent(struct fs *fs, struct fs_file *dir, struct fs_dirent *entry, void *arg) {
+	struct fs_inode inode;
+
+	if (!inumber_in_range(fs, entry->inumber)) {
+		printf("directory %d: %s names inode %d, which is out of range\n", dir->inumber, entry->name, entry->inumber);
+		return 1;
+	}
+	// an unreadable inode block is already reported by the checksum pass
+	if (!inode_load(fs, entry->inumber, &inode)) {
+		return 0;
+	}
+	if (!inode.isvalid) {
+		printf("directory %d: %s names free inode %d\n", dir->inumber, entry->name, entry->inumber);
+		return 1;
+	}
+	if (!inode.named) {
+		printf("directory %d: %s names inode %d, which is not marked as named\n", dir->inumber, entry->name, entry->inumber);
+		return 1;
+	}
+	return 0;
+}
+
+static int fsck_locked(struct fs *fs) {
+	union fs_block block;
+	union fs_block map;
+	int problems = 0;
+
+	if (!fs->is_mounted) {
+		printf("Error: filesystem is not mounted\n");
+		return -1;
+	}
+
+	open_flush_all(fs);
+	discard_flush(fs);
+
+	// every block in use, bar the superblock and the info table, must match its checksum
+	if (checksums_enabled(fs)) {
+		for (int b = 1; b < fs->super.nblocks; b++) {
+			int in_info_table = b > fs->super.ninodeblocks && b <= fs->super.ninodeblocks + fs->super.ninfoblocks;
+			if (in_info_table || fs->free_block_bitmap[b] != 1) {
+				continue;
+			}
+			disk_ctx_read(fs->disk, b, block.data);
+			if (crc32c(0, block.data, DISK_BLOCK_SIZE) != fs->block_info[b].crc) {
+				printf("block %d: checksum mismatch\n", b);
+				problems++;
+			}
+		}
+	}
+
+	uint32_t *refs = calloc(fs->super.nblocks, sizeof(uint32_t));
+	if (!refs) {
+		return -1;
+	}
+
+	for (int i = 1; i <= fs->super.ninodeblocks; i++) {
+		disk_ctx_read(fs->disk, i, block.data);
+		problems += fsck_inode_block(fs, refs, &block, (i - 1) * INODES_PER_BLOCK);
+	}
+
+	if (fs->super.snaptable) {
+		union fs_block table;
+		disk_ctx_read(fs->disk, fs->super.snaptable, table.data);
+		for (int s = 0; s < (int)SNAPSHOTS_PER_BLOCK; s++) {
+			if (!table.snapshot[s].isvalid) {
+				continue;
+			}
+			int index = 0;
+			for (int mapblock = table.snapshot[s].mapblock; mapblock; mapblock = map.pointers[MAP_ENTRIES_PER_BLOCK]) {
+				if (fsck_count(fs, refs, mapblock, "snapshot map", 0)) {
+					problems++;
+					break;
+				}
+				disk_ctx_read(fs->disk, mapblock, map.data);
+				for (int i = 0; i < MAP_ENTRIES_PER_BLOCK; i++, index++) {
+					if (!map.pointers[i]) {
+						continue;
+					}
+					if (fsck_count(fs, refs, map.pointers[i], "snapshot inode table", 0)) {
+						problems++;
+						continue;
+					}
+					disk_ctx_read(fs->disk, map.pointers[i], block.data);
+					problems += fsck_inode_block(fs, refs, &block, index * INODES_PER_BLOCK);
+				}
+			}
+		}
+	}
+
+	// every directory entry must name a live inode
+	if (fs->super.features & FS_FEATURE_DIRS) {
+		int bad = dir_walk_all(fs, fsck_dirent, 0);
+		problems += bad < 0 ? 1 : bad;
+	}
+
+	// the counts found must agree with the info table, or with the bitmap on plain images
+	for (int b = fs->data_start; b < fs->super.nblocks; b++) {
+		if (fs->block_info) {
+			if (refs[b] != fs->block_info[b].refs) {
+				printf("block %d: %u references recorded, %u found\n", b, fs->block_info[b].refs, refs[b]);
+				problems++;
+			}
+		} else if (refs[b] > 1) {
+			printf("block %d: referenced %u times\n", b, refs[b]);
+			problems++;
+		}
+	}
+
+	free(refs);
+	return problems;
+}
+
+int fs_ctx_fsck( struct fs *fs ) {
+	fs_lock_exclusive(fs);
+	int problems = fsck_locked(fs);
+	fs_unlock(fs);
+	return problems;
+}
+
+// image builder: lays a whole tree out in one pass over an unmounted
+// instance; each file or directory gets one run of data blocks followed by
+// its indirect blocks, inumbers are handed out in order, and the inode
+// table, info table and superblock are written once at the end
+
+#define BUILD_BATCH 256
+
+struct build_entry {
+	int inumber;
+	int type;
+	char *host;
+	int64_t size;
+	struct fs_stage stage;
+	int start;
+	int nblocks;
+	int mapstart;
+	int nmaps;
+	struct fs_inode inode;
+};
+
+struct fs_build {
+	struct fs *fs;
+	struct fs_superblock super;
+	int data_start;
+	struct build_entry *entries;
+	int count;
+	int capacity;
+	struct fs_file scratch;
+	struct fs_blockinfo *info;
+	pthread_mutex_t lock;
+	int next;
+	int failed;
+};
+
+// add an entry and link it into its parent, the root for parent 0
+static int build_add(struct fs_build *build, int type, int parent, const char *name, const char *host, int64_t size) {
+	struct fs *fs = build->fs;
+	int dirs = build->super.features & FS_FEATURE_DIRS;
+	int first = dirs ? ROOT_INUMBER : 1;
+	int inumber = first + build->count;
+
+	if (inumber >= build->super.ninodes) {
+		printf("Error: no more room for inodes\n");
+		return 0;
+	}
+	if ((size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE > file_max_blocks(fs)) {
+		printf("Error: %s is too large for this format\n", host);
+		return 0;
+	}
+
+	if (build->count == build->capacity) {
+		int capacity = build->capacity ? build->capacity * 2 : 64;
+		struct build_entry *entries = realloc(build->entries, capacity * sizeof(*entries));
+		if (!entries) {
+			printf("Error: out of memory\n");
+			return 0;
+		}
+		build->entries = entries;
+		build->capacity = capacity;
+	}
+
+	if (dirs && build->count) {
+		if (!parent) parent = ROOT_INUMBER;
+		if (parent < first || parent >= inumber || build->entries[parent - first].type != INODE_DIR) {
+			printf("Error: inode %d is not a directory\n", parent);
+			return 0;
+		}
+		struct build_entry *dir = &build->entries[parent - first];
+		if (!name || !*name || strchr(name, '/') || strlen(name) > FS_NAME_MAX) {
+			printf("Error: bad name: %s\n", name ? name : "");
+			return 0;
+		}
+		file_init(&build->scratch, dir->inumber);
+		build->scratch.stage = &dir->stage;
+		if (!dir_add(fs, &build->scratch, name, inumber)) {
+			return 0;
+		}
+	}
+
+	int named = dirs && build->count;
+	struct build_entry *entry = &build->entries[build->count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->inode.named = named;
+	entry->inumber = inumber;
+	entry->type = type;
+	entry->size = size;
+	if (host && !(entry->host = strdup(host))) {
+		printf("Error: out of memory\n");
+		build->count--;
+		return 0;
+	}
+	return inumber;
+}
+
+struct fs_build *fs_ctx_build_begin( struct fs *fs, int features ) {
+	struct fs_build *build = 0;
+
+	fs_lock_exclusive(fs);
+	if (fs->is_mounted) {
+		printf("Error: the filesystem is mounted\n");
+	} else if ((build = calloc(1, sizeof(*build)))) {
+		if (format_super(fs, features, &build->super)) {
+			// the directory code sizes its files from the superblock
+			fs->super = build->super;
+			build->fs = fs;
+			build->data_start = 1 + build->super.ninodeblocks + build->super.ninfoblocks + (build->super.snaptable ? 1 : 0);
+			pthread_mutex_init(&build->lock, 0);
+		} else {
+			free(build);
+			build = 0;
+		}
+	} else {
+		printf("Error: out of memory\n");
+	}
+	fs_unlock(fs);
+
+	if (build && (features & FS_FEATURE_DIRS) && build_add(build, INODE_DIR, 0, 0, 0, 0) != ROOT_INUMBER) {
+		fs_build_abort(build);
+		build = 0;
+	}
+	return build;
+}
+
+int fs_build_mkdir( struct fs_build *build, int parent, const char *name ) {
+	if (!(build->super.features & FS_FEATURE_DIRS)) {
+		printf("Error: filesystem was not formatted with directories\n");
+		return 0;
+	}
+	return build_add(build, INODE_DIR, parent, name, 0, 0);
+}
+
+int fs_build_file( struct fs_build *build, int parent, const char *name, const char *host, int64_t size ) {
+	return build_add(build, INODE_FILE, parent, name, host, size);
+}
+
+// the next logical block at or after lblock that holds data, or -1
+static int64_t build_next(struct build_entry *entry, int64_t lblock) {
+	if (entry->host) {
+		return lblock * DISK_BLOCK_SIZE < entry->size ? lblock : -1;
+	}
+	while (lblock < entry->stage.nblocks && !entry->stage.present[lblock]) lblock++;
+	return lblock < entry->stage.nblocks ? lblock : -1;
+}
+
+// point the inode and indirect blocks of an entry at its data run, the
+// indirect blocks going to maps in the order they are first needed; with
+// maps null only count them
+static int build_maps(struct fs *fs, struct build_entry *entry, union fs_block *maps) {
+	int64_t node[INDIRECT_LEVELS + 1];
+	int slot[INDIRECT_LEVELS + 1];
+	int nmaps = 0;
+	int tree = 0;
+	int rank = 0;
+
+	for (int64_t lblock = build_next(entry, 0); lblock >= 0; lblock = build_next(entry, lblock + 1)) {
+		int blocknum = entry->start + rank++;
+		if (lblock < direct_count(fs)) {
+			entry->inode.direct[lblock] = blocknum;
+			continue;
+		}
+
+		int64_t offset = lblock - direct_count(fs);
+		int levels = 1;
+		while (offset >= tree_span(levels)) {
+			offset -= tree_span(levels);
+			levels++;
+		}
+		if (levels != tree) {
+			tree = levels;
+			for (int h = 1; h <= levels; h++) node[h] = -1;
+		}
+
+		// the block at height h covers tree_span(h) data blocks
+		for (int h = levels; h >= 1; h--) {
+			int64_t id = offset / tree_span(h);
+			if (node[h] == id) continue;
+			node[h] = id;
+			slot[h] = nmaps++;
+			if (maps) {
+				int mapblock = entry->mapstart + slot[h];
+				memset(maps[slot[h]].data, 0, DISK_BLOCK_SIZE);
+				if (h == levels) {
+					entry->inode.indirect[levels - 1] = mapblock;
+				} else {
+					maps[slot[h + 1]].pointers[id % POINTERS_PER_BLOCK] = mapblock;
+				}
+			}
+		}
+		if (maps) {
+			maps[slot[1]].pointers[offset % POINTERS_PER_BLOCK] = blocknum;
+		}
+	}
+	return nmaps;
+}
+
+// fill in the info entries of blocks about to be written
+static void build_seal(struct fs_build *build, int blocknum, union fs_block *blocks, int count, int data) {
+	if (!build->info) {
+		return;
+	}
+	for (int i = 0; i < count; i++) {
+		if (build->super.features & FS_FEATURE_CHECKSUMS) {
+			build->info[blocknum + i].crc = crc32c(0, blocks[i].data, DISK_BLOCK_SIZE);
+		}
+		if (data && (build->super.features & FS_FEATURE_DEDUP)) {
+			build->info[blocknum + i].hash = block_hash(blocks[i].data);
+		}
+	}
+}
+
+static int build_read(int fd, char *data, size_t length, off_t offset) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t result = pread(fd, data + done, length - done, offset + done);
+		if (result < 0 && errno == EINTR) continue;
+		if (result < 0) return 0;
+		if (result == 0) break;
+		done += result;
+	}
+	// a file that shrank since it was added reads as zeros past its end
+	memset(data + done, 0, length - done);
+	return 1;
+}
+
+static int build_write_entry(struct fs_build *build, struct build_entry *entry, union fs_block *batch) {
+	struct fs *fs = build->fs;
+	int fd = -1;
+	int64_t lblock = 0;
+
+	if (entry->host && (fd = open(entry->host, O_RDONLY)) < 0) {
+		printf("Error: cannot open %s: %s\n", entry->host, strerror(errno));
+		return 0;
+	}
+
+	for (int done = 0; done < entry->nblocks; ) {
+		int count = entry->nblocks - done < BUILD_BATCH ? entry->nblocks - done : BUILD_BATCH;
+		if (fd >= 0) {
+			if (!build_read(fd, batch[0].data, (size_t)count * DISK_BLOCK_SIZE, (off_t)done * DISK_BLOCK_SIZE)) {
+				printf("Error: cannot read %s: %s\n", entry->host, strerror(errno));
+				close(fd);
+				return 0;
+			}
+		} else {
+			for (int i = 0; i < count; i++) {
+				lblock = build_next(entry, lblock);
+				batch[i] = entry->stage.blocks[lblock++];
+			}
+		}
+		build_seal(build, entry->start + done, batch, count, 1);
+		disk_ctx_write_blocks(fs->disk, entry->start + done, count, batch[0].data);
+		done += count;
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	if (entry->nmaps) {
+		union fs_block *maps = malloc((size_t)entry->nmaps * sizeof(*maps));
+		if (!maps) {
+			printf("Error: out of memory\n");
+			return 0;
+		}
+		build_maps(fs, entry, maps);
+		build_seal(build, entry->mapstart, maps, entry->nmaps, 0);
+		disk_ctx_write_blocks(fs->disk, entry->mapstart, entry->nmaps, maps[0].data);
+		free(maps);
+	}
+
+	entry->inode.isvalid = entry->type;
+	entry->inode.size = entry->host ? entry->size : (int64_t)entry->stage.nblocks * DISK_BLOCK_SIZE;
+	return 1;
+}
+
+static void *build_worker(void *arg) {
+	struct fs_build *build = arg;
+	union fs_block *batch = malloc(BUILD_BATCH * sizeof(*batch));
+
+	while (batch) {
+		pthread_mutex_lock(&build->lock);
+		int i = build->next < build->count ? build->next++ : -1;
+		pthread_mutex_unlock(&build->lock);
+		if (i < 0) break;
+
+		if (!build_write_entry(build, &build->entries[i], batch)) {
+			pthread_mutex_lock(&build->lock);
+			build->failed = 1;
+			pthread_mutex_unlock(&build->lock);
+		}
+	}
+	if (!batch) {
+		printf("Error: out of memory\n");
+		pthread_mutex_lock(&build->lock);
+		build->failed = 1;
+		pthread_mutex_unlock(&build->lock);
+	}
+	free(batch);
+	return 0;
+}
+
+// everything but the data: inode table, snapshot table, info table, and
+// the superblock last, so a build that dies halfway leaves no valid image
+static int build_write_meta(struct fs_build *build, union fs_block *batch) {
+	struct fs *fs = build->fs;
+	struct fs_superblock *sb = &build->super;
+	int e = 0;
+
+	for (int i = 1; i <= sb->ninodeblocks; i += BUILD_BATCH) {
+		int count = sb->ninodeblocks - i + 1 < BUILD_BATCH ? sb->ninodeblocks - i + 1 : BUILD_BATCH;
+		memset(batch, 0, (size_t)count * sizeof(*batch));
+		for (; e < build->count && get_block_num(build->entries[e].inumber) < i + count; e++) {
+			struct build_entry *entry = &build->entries[e];
+			inode_encode(fs, &batch[get_block_num(entry->inumber) - i], entry->inumber % INODES_PER_BLOCK, &entry->inode);
+		}
+		build_seal(build, i, batch, count, 0);
+		disk_ctx_write_blocks(fs->disk, i, count, batch[0].data);
+	}
+
+	if (sb->snaptable) {
+		memset(batch[0].data, 0, DISK_BLOCK_SIZE);
+		build_seal(build, sb->snaptable, batch, 1, 0);
+		disk_ctx_write(fs->disk, sb->snaptable, batch[0].data);
+	}
+
+	if (build->info) {
+		disk_ctx_write_blocks(fs->disk, 1 + sb->ninodeblocks, sb->ninfoblocks, (const char *)build->info);
+	}
+
+	memset(batch[0].data, 0, DISK_BLOCK_SIZE);
+	batch[0].super = *sb;
+	disk_ctx_write(fs->disk, 0, batch[0].data);
+	return 1;
+}
+
+static int build_finish_locked(struct fs_build *build, int threads) {
+	struct fs *fs = build->fs;
+	struct fs_superblock *sb = &build->super;
+
+	if (fs->is_mounted) {
+		printf("Error: the filesystem was mounted during the build\n");
+		return 0;
+	}
+	fs->super = *sb;
+
+	// place every entry, data first and then its indirect blocks
+	int64_t next = build->data_start;
+	for (int i = 0; i < build->count; i++) {
+		struct build_entry *entry = &build->entries[i];
+		int nblocks = 0;
+		for (int64_t lblock = build_next(entry, 0); lblock >= 0; lblock = build_next(entry, lblock + 1)) {
+			nblocks++;
+		}
+		entry->start = next;
+		entry->nblocks = nblocks;
+		next += nblocks;
+		entry->mapstart = next;
+		entry->nmaps = build_maps(fs, entry, 0);
+		next += entry->nmaps;
+	}
+	if (next > sb->nblocks) {
+		printf("Error: the tree needs %lld data blocks, the image has %d\n", (long long)(next - build->data_start), sb->nblocks - build->data_start);
+		return 0;
+	}
+
+	if (sb->ninfoblocks) {
+		build->info = calloc(sb->ninfoblocks, DISK_BLOCK_SIZE);
+		if (!build->info) {
+			printf("Error: out of memory\n");
+			return 0;
+		}
+		for (int b = build->data_start; b < next; b++) {
+			build->info[b].refs = 1;
+		}
+	}
+
+	union fs_block *batch = malloc(BUILD_BATCH * sizeof(*batch));
+	if (!batch) {
+		printf("Error: out of memory\n");
+		return 0;
+	}
+
+	// nothing on the disk is valid until the superblock goes back at the end
+	memset(batch[0].data, 0, DISK_BLOCK_SIZE);
+	disk_ctx_write(fs->disk, 0, batch[0].data);
+
+	if (threads < 1) threads = 1;
+	if (threads > build->count) threads = build->count ? build->count : 1;
+	pthread_t *workers = calloc(threads, sizeof(*workers));
+	int started = 0;
+	if (workers) {
+		for (; started < threads; started++) {
+			if (pthread_create(&workers[started], 0, build_worker, build)) break;
+		}
+	}
+	if (!started) {
+		build_worker(build);
+	}
+	for (int i = 0; i < started; i++) {
+		pthread_join(workers[i], 0);
+	}
+	free(workers);
+
+	int result = !build->failed && build_write_meta(build, batch);
+	free(batch);
+	return result;
+}
+
+int fs_build_finish( struct fs_build *build, int threads ) {
+	struct fs *fs = build->fs;
+
+	fs_lock_exclusive(fs);
+	int result = build_finish_locked(build, threads);
+	fs_unlock(fs);
+
+	fs_build_abort(build);
+	return result;
+}
+
+void fs_build_abort( struct fs_build *build ) {
+	if (!build) {
+		return;
+	}
+	for (int i = 0; i < build->count; i++) {
+		free(build->entries[i].host);
+		free(build->entries[i].stage.blocks);
+		free(build->entries[i].stage.present);
+	}
+	free(build->entries);
+	free(build->info);
+	pthread_mutex_destroy(&build->lock);
+	free(build);
+}
+
+// instances
+
+struct fs *fs_ctx_new( struct disk *disk ) {
+	struct fs *fs = calloc(1, sizeof(*fs));
+	if (!fs) {
+		printf("Error: out of memory\n");
+		return 0;
+	}
+	fs->disk = disk;
+	fs->shard_blocks = 1;
+	locks_init(fs);
+	return fs;
+}
+
+// unmounts first if needed, which writes back anything still open; the
+// disk is left open for the caller
+void fs_ctx_free( struct fs *fs ) {
+	if (!fs) {
+		return;
+	}
+	fs_ctx_unmount(fs);
+	pthread_rwlock_destroy(&fs->fs_lock);
+	for (int i = 0; i < INODE_LOCKS; i++) {
+		pthread_rwlock_destroy(&fs->inode_locks[i]);
+	}
+	for (int i = 0; i < INODE_BLOCK_LOCKS; i++) {
+		pthread_mutex_destroy(&fs->inode_block_locks[i]);
+	}
+	pthread_mutex_destroy(&fs->dedup_lock);
+	pthread_mutex_destroy(&fs->discard_lock);
+	pthread_mutex_destroy(&fs->open_lock);
+	free(fs);
+}
+
+// the instance behind the original single-filesystem calls, on the default disk
+static struct fs default_fs;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void default_init() {
+	default_fs.disk = disk_default();
+	default_fs.shard_blocks = 1;
+	locks_init(&default_fs);
+}
+
+struct fs *fs_default() {
+	pthread_once(&default_once, default_init);
+	return &default_fs;
+}
+
+void fs_debug() {
+	fs_ctx_debug(fs_default());
+}
+
+int fs_format() {
+	return fs_ctx_format(fs_default());
+}
+
+int fs_format_features( int features ) {
+	return fs_ctx_format_features(fs_default(), features);
+}
+
+int fs_mount() {
+	return fs_ctx_mount(fs_default());
+}
+
+int fs_unmount() {
+	return fs_ctx_unmount(fs_default());
+}
+
+int fs_create() {
+	return fs_ctx_create(fs_default());
+}
+
+int fs_delete( int inumber ) {
+	return fs_ctx_delete(fs_default(), inumber);
+}
+
+int64_t fs_getsize( int inumber ) {
+	return fs_ctx_getsize(fs_default(), inumber);
+}
+
+int fs_read( int inumber, char *data, int length, int64_t offset ) {
+	return fs_ctx_read(fs_default(), inumber, data, length, offset);
+}
+
+int fs_write( int inumber, const char *data, int length, int64_t offset ) {
+	return fs_ctx_write(fs_default(), inumber, data, length, offset);
+}
+
+struct fs_handle *fs_open( int inumber ) {
+	return fs_ctx_open(fs_default(), inumber);
+}
+
+int fs_snapshot_create() {
+	return fs_ctx_snapshot_create(fs_default());
+}
+
+int fs_snapshot_delete( int snapid ) {
+	return fs_ctx_snapshot_delete(fs_default(), snapid);
+}
+
+int fs_snapshot_list() {
+	return fs_ctx_snapshot_list(fs_default());
+}
+
+int fs_snapshot_read( int snapid, int inumber, char *data, int length, int64_t offset ) {
+	return fs_ctx_snapshot_read(fs_default(), snapid, inumber, data, length, offset);
+}
+
+int fs_lookup( const char *path ) {
+	return fs_ctx_lookup(fs_default(), path);
+}
+
+int fs_create_path( const char *path ) {
+	return fs_ctx_create_path(fs_default(), path);
+}
+
+int fs_mkdir( const char *path ) {
+	return fs_ctx_mkdir(fs_default(), path);
+}
+
+int fs_unlink( const char *path ) {
+	return fs_ctx_unlink(fs_default(), path);
+}
+
+int fs_list( const char *path ) {
+	return fs_ctx_list(fs_default(), path);
+}
+
+int fs_set_discard( int enabled ) {
+	return fs_ctx_set_discard(fs_default(), enabled);
+}
+
+int fs_trim() {
+	return fs_ctx_trim(fs_default());
+}
+
+int fs_fsck() {
+	return fs_ctx_fsck(fs_default());
+}
+
+struct fs_build *fs_build_begin( int features ) {
+	return fs_ctx_build_begin(fs_default(), features);
+}
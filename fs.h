@@ -1,15 +1,136 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdint.h>
+
+#define FS_FEATURE_DEDUP     0x1
+#define FS_FEATURE_SNAPSHOTS 0x2
+#define FS_FEATURE_DIRS      0x4
+#define FS_FEATURE_CHECKSUMS 0x8
+#define FS_FEATURE_LARGE     0x10
+
+#define FS_NAME_MAX 27
+
+#define FS_SEEK_SET 0
+#define FS_SEEK_CUR 1
+#define FS_SEEK_END 2
+
+struct disk;
+struct fs;
+struct fs_handle;
+struct fs_build;
+
+/*
+Each struct fs is one filesystem on its own disk, with its own locks,
+allocator, dedup index and open files, so a process can mount many.
+fs_ctx_new binds one to a disk without touching it; format or mount
+it next.  The plain fs_* calls act on a default instance on the default
+disk, and handles remember the instance they were opened on.
+*/
+
+struct fs * fs_ctx_new( struct disk *disk );
+void fs_ctx_free( struct fs *fs );
+struct fs * fs_default();
+
+void fs_ctx_debug( struct fs *fs );
+int  fs_ctx_format( struct fs *fs );
+int  fs_ctx_format_features( struct fs *fs, int features );
+int  fs_ctx_mount( struct fs *fs );
+int  fs_ctx_unmount( struct fs *fs );
+
+int  fs_ctx_create( struct fs *fs );
+int  fs_ctx_delete( struct fs *fs, int inumber );
+int64_t fs_ctx_getsize( struct fs *fs, int inumber );
+
+int  fs_ctx_read( struct fs *fs, int inumber, char *data, int length, int64_t offset );
+int  fs_ctx_write( struct fs *fs, int inumber, const char *data, int length, int64_t offset );
+
+struct fs_handle *fs_ctx_open( struct fs *fs, int inumber );
+
+int  fs_ctx_snapshot_create( struct fs *fs );
+int  fs_ctx_snapshot_delete( struct fs *fs, int snapid );
+int  fs_ctx_snapshot_list( struct fs *fs );
+int  fs_ctx_snapshot_read( struct fs *fs, int snapid, int inumber, char *data, int length, int64_t offset );
+
+int  fs_ctx_lookup( struct fs *fs, const char *path );
+int  fs_ctx_create_path( struct fs *fs, const char *path );
+int  fs_ctx_mkdir( struct fs *fs, const char *path );
+int  fs_ctx_unlink( struct fs *fs, const char *path );
+int  fs_ctx_list( struct fs *fs, const char *path );
+
+int  fs_ctx_set_discard( struct fs *fs, int enabled );
+int  fs_ctx_trim( struct fs *fs );
+
+int  fs_ctx_fsck( struct fs *fs );
+
+/*
+Feature names as the tools take them: dedup, snapshots, dirs, checksums,
+large or none, separated by commas or spaces.  Returns the FS_FEATURE_*
+bits named, or -1 if a name is unknown.
+*/
+
+int  fs_parse_features( const char *list );
+
+/*
+Building an image in one pass: begin writes nothing yet; the entries
+added after it are laid out and written, together with a fresh format,
+by finish, which uses up to threads threads to copy the data.  Parents
+are inumbers returned by fs_build_mkdir, or 0 for the root; without
+directories they and the names are ignored.  The instance must stay
+unmounted until finish or abort, which both free the build.
+*/
+
+struct fs_build *fs_ctx_build_begin( struct fs *fs, int features );
+int  fs_build_mkdir( struct fs_build *build, int parent, const char *name );
+int  fs_build_file( struct fs_build *build, int parent, const char *name, const char *host, int64_t size );
+int  fs_build_finish( struct fs_build *build, int threads );
+void fs_build_abort( struct fs_build *build );
+
 void fs_debug();
 int  fs_format();
+int  fs_format_features( int features );
 int  fs_mount();
+int  fs_unmount();
 
 int  fs_create();
 int  fs_delete( int inumber );
-int  fs_getsize();
+int64_t fs_getsize( int inumber );
+
+int  fs_read( int inumber, char *data, int length, int64_t offset );
+int  fs_write( int inumber, const char *data, int length, int64_t offset );
+
+struct fs_handle *fs_open( int inumber );
+int  fs_close( struct fs_handle *handle );
+int  fs_handle_read( struct fs_handle *handle, char *data, int length );
+int  fs_handle_write( struct fs_handle *handle, const char *data, int length );
+int64_t fs_seek( struct fs_handle *handle, int64_t offset, int whence );
+
+/*
+Copy between a host file descriptor, from or at its current position,
+and a handle, up to length bytes or the end of the source.  Whole blocks
+go between a regular host file and the image without being copied
+through memory.
+*/
+
+int64_t fs_handle_copyin( struct fs_handle *handle, int fd, int64_t length );
+int64_t fs_handle_copyout( struct fs_handle *handle, int fd, int64_t length );
+
+int  fs_snapshot_create();
+int  fs_snapshot_delete( int snapid );
+int  fs_snapshot_list();
+int  fs_snapshot_read( int snapid, int inumber, char *data, int length, int64_t offset );
+
+int  fs_lookup( const char *path );
+int  fs_create_path( const char *path );
+int  fs_mkdir( const char *path );
+int  fs_unlink( const char *path );
+int  fs_list( const char *path );
+
+int  fs_set_discard( int enabled );
+int  fs_trim();
+
+int  fs_fsck();
 
-int  fs_read( int inumber, char *data, int length, int offset );
-int  fs_write( int inumber, const char *data, int length, int offset );
+struct fs_build *fs_build_begin( int features );
 
 #endif
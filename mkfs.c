@@ -0,0 +1,177 @@
+#include "fs.h"
+#include "disk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+simplefs-mkfs formats an image and fills it with a copy of a directory
+tree on the host, in one pass: the whole tree is laid out in memory
+first, then the file data goes out in large sequential writes from
+several threads, and the inode and allocation tables are written once.
+
+Entries are added in sorted order, so the same tree always gives the
+same image.  Without the dirs feature the tree is flattened and the
+inumber of every file is printed.
+*/
+
+static int features = FS_FEATURE_DIRS;
+static int verbose = 0;
+static int nfiles = 0;
+static int ndirs = 0;
+static int64_t nbytes = 0;
+
+static double now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec/1e9;
+}
+
+/*
+Add everything below path to the build, under the directory parent.
+*/
+
+static int add_tree( struct fs_build *build, int parent, const char *path )
+{
+	struct dirent **names;
+	struct stat info;
+	char *child;
+	int i, n, inumber, result = 1;
+
+	n = scandir(path,&names,0,alphasort);
+	if(n<0) {
+		fprintf(stderr,"couldn't read %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	for(i=0;i<n;i++) {
+		const char *name = names[i]->d_name;
+
+		if(!result || !strcmp(name,".") || !strcmp(name,"..")) {
+			free(names[i]);
+			continue;
+		}
+
+		child = malloc(strlen(path)+strlen(name)+2);
+		if(!child) {
+			fprintf(stderr,"out of memory\n");
+			result = 0;
+			free(names[i]);
+			continue;
+		}
+		sprintf(child,"%s/%s",path,name);
+
+		if(lstat(child,&info)<0) {
+			fprintf(stderr,"couldn't stat %s: %s\n",child,strerror(errno));
+			result = 0;
+		} else if(S_ISDIR(info.st_mode)) {
+			if(features&FS_FEATURE_DIRS) {
+				inumber = fs_build_mkdir(build,parent,name);
+				result = inumber && add_tree(build,inumber,child);
+				if(inumber && verbose) fprintf(stderr,"%d %s/\n",inumber,child);
+			} else {
+				result = add_tree(build,0,child);
+			}
+			ndirs++;
+		} else if(S_ISREG(info.st_mode)) {
+			inumber = fs_build_file(build,parent,name,child,info.st_size);
+			result = inumber!=0;
+			if(inumber && !(features&FS_FEATURE_DIRS)) printf("%d %s\n",inumber,child);
+			else if(inumber && verbose) fprintf(stderr,"%d %s\n",inumber,child);
+			nfiles++;
+			nbytes += info.st_size;
+		} else {
+			fprintf(stderr,"skipping %s: not a regular file or directory\n",child);
+		}
+
+		free(child);
+		free(names[i]);
+	}
+
+	free(names);
+	return result;
+}
+
+int main( int argc, char *argv[] )
+{
+	struct fs_build *build;
+	int i, threads, check = 0;
+	int64_t nblocks;
+	double start, seconds;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for(i=1;i<argc;i++) {
+		if(!strcmp(argv[i],"-f") && i+1<argc) {
+			features = fs_parse_features(argv[++i]);
+		} else if(!strcmp(argv[i],"-j") && i+1<argc) {
+			threads = atoi(argv[++i]);
+		} else if(!strcmp(argv[i],"-c")) {
+			check = 1;
+		} else if(!strcmp(argv[i],"-v")) {
+			verbose = 1;
+		} else {
+			break;
+		}
+	}
+
+	if(argc-i!=3 || features<0 || threads<1 || atoll(argv[i+1])<1) {
+		printf("use: %s [-f dedup,snapshots,dirs,checksums,large] [-j threads] [-c] [-v]\n",argv[0]);
+		printf("       <diskfile> <nblocks> <directory>\n");
+		return 1;
+	}
+
+	nblocks = atoll(argv[i+1]);
+	if(!disk_init(argv[i],nblocks)) {
+		printf("couldn't initialize %s: %s\n",argv[i],strerror(errno));
+		return 1;
+	}
+
+	start = now();
+
+	build = fs_build_begin(features);
+	if(!build) {
+		disk_close();
+		return 1;
+	}
+
+	if(!add_tree(build,0,argv[i+2])) {
+		fs_build_abort(build);
+		disk_close();
+		return 1;
+	}
+
+	if(!fs_build_finish(build,threads)) {
+		printf("build failed\n");
+		disk_close();
+		return 1;
+	}
+
+	seconds = now()-start;
+	printf("%d files, %d directories, %.1f MB in %.3f s (%.1f MB/s)\n",
+		nfiles,ndirs,nbytes/1e6,seconds,seconds>0 ? nbytes/1e6/seconds : 0.0);
+
+	if(check) {
+		if(!fs_mount()) {
+			printf("mount failed\n");
+			disk_close();
+			return 1;
+		}
+		if(fs_fsck()) {
+			disk_close();
+			return 1;
+		}
+		fs_unmount();
+	}
+
+	disk_close();
+	return 0;
+}
@@ -1,34 +1,62 @@
-
 #include "fs.h"
 #include "disk.h"
+#include "crc32c.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
+static int run_command( const char *line );
+static int do_batch( const char *script, const char *format, int verbose );
 static int do_copyin( const char *filename, int inumber );
-static int do_copyout( int inumber, const char *filename );
+static int do_copyout( int snapid, int inumber, const char *filename );
+static int do_stress( int maxthreads, int size, int nfiles );
+static int resolve_inode( const char *arg, int create );
+static int do_crcbench( int nblocks );
+static double elapsed_since( struct timespec *start );
 
 int main( int argc, char *argv[] )
 {
 	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
+	const char *script = 0;
+	const char *format = "text";
+	int verbose = 0, i, result;
+
+	for(i=3;i<argc;i++) {
+		if(!strcmp(argv[i],"-b") && i+1<argc) {
+			script = argv[++i];
+		} else if(!strcmp(argv[i],"-o") && i+1<argc) {
+			format = argv[++i];
+		} else if(!strcmp(argv[i],"-v")) {
+			verbose = 1;
+		} else {
+			break;
+		}
+	}
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc<3 || i<argc || (strcmp(format,"text") && strcmp(format,"csv") && strcmp(format,"json"))) {
+		printf("use: %s <diskfile> <nblocks> [-b <script>] [-o text|csv|json] [-v]\n",argv[0]);
 		return 1;
 	}
 
-	if(!disk_init(argv[1],atoi(argv[2]))) {
+	if(!disk_init(argv[1],atoll(argv[2]))) {
 		printf("couldn't initialize %s: %s\n",argv[1],strerror(errno));
 		return 1;
 	}
 
-	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
+	if(script) {
+		result = do_batch(script,format,verbose);
+		disk_close();
+		return result ? 0 : 1;
+	}
+
+	printf("opened emulated disk image %s with %lld blocks\n",argv[1],(long long)disk_size());
 
 	while(1) {
 		printf(" simplefs> ");
@@ -39,126 +67,7 @@ int main( int argc, char *argv[] )
 		if(line[0]=='\n') continue;
 		line[strlen(line)-1] = 0;
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
-
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
-			} else {
-				printf("use: format\n");
-			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
-			} else {
-				printf("use: mount\n");
-			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
-			} else {
-				printf("use: debug\n");
-			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
-			} else {
-				printf("use: getsize <inumber>\n");
-			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
-			} else {
-				printf("use: create\n");
-			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
-				} else {
-					printf("delete failed!\n");	
-				}
-			} else {
-				printf("use: delete <inumber>\n");
-			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
-			} else {
-				printf("use: cat <inumber>\n");
-			}
-
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
-			} else {
-				printf("use: copyin <filename> <inumber>\n");
-			}
-
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
-			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
-		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
-		}
+		if(run_command(line)<0) break;
 	}
 
 	printf("closing emulated disk.\n");
@@ -167,63 +76,928 @@ int main( int argc, char *argv[] )
 	return 0;
 }
 
+/*
+Run one command line.  Returns 1 if it worked, 0 if it failed or was
+malformed, and -1 for quit or exit.
+*/
+
+static int run_command( const char *line )
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	char arg3[1024];
+	char arg4[1024];
+	char arg5[1024];
+	int inumber, snapid, result, args;
+	int64_t size;
+	int ok = 1;
+
+	args = sscanf(line,"%s %s %s %s %s %s",cmd,arg1,arg2,arg3,arg4,arg5);
+	if(args<=0) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		char *options[] = { arg1, arg2, arg3, arg4, arg5 };
+		int features = 0, feature, i, valid = 1;
+		for(i=0;i<args-1;i++) {
+			feature = fs_parse_features(options[i]);
+			if(feature<0) valid = 0;
+			else features |= feature;
+		}
+		if(valid) {
+			if(fs_format_features(features)) {
+				printf("disk formatted.\n");
+			} else {
+				printf("format failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: format [dedup] [snapshots] [dirs] [checksums] [large]\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				printf("disk mounted.\n");
+			} else {
+				printf("mount failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: mount\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"unmount")) {
+		if(args==1) {
+			if(fs_unmount()) {
+				printf("disk unmounted.\n");
+			} else {
+				printf("unmount failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: unmount\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			printf("use: debug\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			size = fs_getsize(inumber);
+			if(size>=0) {
+				printf("inode %d has size %lld\n",inumber,(long long)size);
+			} else {
+				printf("getsize failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: getsize <inumber>\n");
+			ok = 0;
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				printf("created inode %d\n",inumber);
+			} else {
+				printf("create failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: create\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(fs_delete(inumber)) {
+				printf("inode %d deleted.\n",inumber);
+			} else {
+				printf("delete failed!\n");	
+				ok = 0;
+			}
+		} else {
+			printf("use: delete <inumber>\n");
+			ok = 0;
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = resolve_inode(arg1,0);
+			if(!inumber || !do_copyout(0,inumber,"/dev/stdout")) {
+				printf("cat failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: cat <inumber|path>\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			inumber = resolve_inode(arg2,1);
+			if(inumber && do_copyin(arg1,inumber)) {
+				printf("copied file %s to inode %d\n",arg1,inumber);
+			} else {
+				printf("copy failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: copyin <filename> <inumber|path>\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3) {
+			inumber = resolve_inode(arg1,0);
+			if(inumber && do_copyout(0,inumber,arg2)) {
+				printf("copied inode %d to file %s\n",inumber,arg2);
+			} else {
+				printf("copy failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: copyout <inumber|path> <filename>\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"mkdir")) {
+		if(args==2) {
+			inumber = fs_mkdir(arg1);
+			if(inumber>0) {
+				printf("created directory %s as inode %d\n",arg1,inumber);
+			} else {
+				printf("mkdir failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: mkdir <path>\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"ls")) {
+		if(args==1 || args==2) {
+			result = fs_list(args==2 ? arg1 : "/");
+			if(result<0) {
+				printf("ls failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: ls [path]\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"rm")) {
+		if(args==2) {
+			if(fs_unlink(arg1)) {
+				printf("removed %s\n",arg1);
+			} else {
+				printf("rm failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: rm <path>\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"snapshot")) {
+		if(args==2 && !strcmp(arg1,"create")) {
+			snapid = fs_snapshot_create();
+			if(snapid>0) {
+				printf("created snapshot %d\n",snapid);
+			} else {
+				printf("snapshot failed!\n");
+				ok = 0;
+			}
+		} else if(args==2 && !strcmp(arg1,"list")) {
+			result = fs_snapshot_list();
+			if(result>=0) {
+				printf("%d snapshots\n",result);
+			} else {
+				printf("snapshot list failed!\n");
+				ok = 0;
+			}
+		} else if(args==3 && !strcmp(arg1,"delete")) {
+			snapid = atoi(arg2);
+			if(fs_snapshot_delete(snapid)) {
+				printf("snapshot %d deleted.\n",snapid);
+			} else {
+				printf("snapshot delete failed!\n");
+				ok = 0;
+			}
+		} else if(args==4 && !strcmp(arg1,"cat")) {
+			snapid = atoi(arg2);
+			inumber = atoi(arg3);
+			if(!do_copyout(snapid,inumber,"/dev/stdout")) {
+				printf("cat failed!\n");
+				ok = 0;
+			}
+		} else if(args==5 && !strcmp(arg1,"copyout")) {
+			snapid = atoi(arg2);
+			inumber = atoi(arg3);
+			if(do_copyout(snapid,inumber,arg4)) {
+				printf("copied inode %d of snapshot %d to file %s\n",inumber,snapid,arg4);
+			} else {
+				printf("copy failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: snapshot create|list|delete <id>|cat <id> <inode>|copyout <id> <inode> <file>\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"discard")) {
+		if(args==2 && (!strcmp(arg1,"on") || !strcmp(arg1,"off"))) {
+			fs_set_discard(!strcmp(arg1,"on"));
+			printf("discard %s.\n",arg1);
+		} else {
+			printf("use: discard on|off\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"fstrim")) {
+		if(args==1) {
+			result = fs_trim();
+			if(result>=0) {
+				printf("%d blocks (%.1f MB) trimmed\n",result,result*(double)DISK_BLOCK_SIZE/(1024*1024));
+			} else {
+				printf("fstrim failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: fstrim\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"fsck")) {
+		if(args==1) {
+			result = fs_fsck();
+			if(result>=0) {
+				printf("fsck: %d problems found\n",result);
+			} else {
+				printf("fsck failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: fsck\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"crcbench")) {
+		if(args==1 || args==2) {
+			if(!do_crcbench(args==2 ? atoi(arg1) : disk_size())) {
+				printf("crcbench failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: crcbench [blocks]\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"stress")) {
+		if(args==3 || args==4) {
+			if(!do_stress(atoi(arg1),atoi(arg2),args==4 ? atoi(arg3) : 64)) {
+				printf("stress failed!\n");
+				ok = 0;
+			}
+		} else {
+			printf("use: stress <maxthreads> <filesize> [files]\n");
+			ok = 0;
+		}
+
+	} else if(!strcmp(cmd,"help")) {
+		printf("Commands are:\n");
+		printf("    format  [dedup] [snapshots] [dirs] [checksums] [large]\n");
+		printf("    mount\n");
+		printf("    unmount\n");
+		printf("    debug\n");
+		printf("    create\n");
+		printf("    delete  <inode>\n");
+		printf("    cat     <inode|path>\n");
+		printf("    copyin  <file> <inode|path>\n");
+		printf("    copyout <inode|path> <file>\n");
+		printf("    mkdir   <path>\n");
+		printf("    ls      [path]\n");
+		printf("    rm      <path>\n");
+		printf("    snapshot create\n");
+		printf("    snapshot list\n");
+		printf("    snapshot delete  <id>\n");
+		printf("    snapshot cat     <id> <inode>\n");
+		printf("    snapshot copyout <id> <inode> <file>\n");
+		printf("    discard on|off\n");
+		printf("    fstrim\n");
+		printf("    fsck\n");
+		printf("    crcbench [blocks]\n");
+		printf("    stress  <maxthreads> <filesize> [files]\n");
+		printf("    help\n");
+		printf("    quit\n");
+		printf("    exit\n");
+	} else if(!strcmp(cmd,"quit")) {
+		ok = -1;
+	} else if(!strcmp(cmd,"exit")) {
+		ok = -1;
+	} else {
+		printf("unknown command: %s\n",cmd);
+		printf("type 'help' for a list of commands.\n");
+		ok = 0;
+	}
+
+	return ok;
+}
+
+/*
+A plain number names an inode directly, anything else is a path.
+With create set, a path that does not exist yet is created as a file.
+*/
+
+static int resolve_inode( const char *arg, int create )
+{
+	int inumber;
+
+	if(arg[0] && strspn(arg,"0123456789")==strlen(arg)) {
+		return atoi(arg);
+	}
+
+	inumber = fs_lookup(arg);
+	if(!inumber && create) {
+		inumber = fs_create_path(arg);
+	}
+	if(!inumber) {
+		printf("%s: no such file\n",arg);
+	}
+	return inumber;
+}
+
 static int do_copyin( const char *filename, int inumber )
 {
-	FILE *file;
-	int offset=0, result, actual;
+	struct fs_handle *handle;
+	struct stat info;
+	int64_t result;
+	int fd;
+
+	fd = open(filename,O_RDONLY);
+	if(fd<0) {
+		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	handle = fs_open(inumber);
+	if(!handle) {
+		close(fd);
+		return 0;
+	}
+
+	result = fs_handle_copyin(handle,fd,INT64_MAX);
+	if(result<0) {
+		printf("ERROR: fs_handle_copyin return invalid result %lld\n",(long long)result);
+		fs_close(handle);
+		close(fd);
+		return 0;
+	}
+
+	printf("%lld bytes copied\n",(long long)result);
+
+	// pipes have no size to check against, so only regular files can come up short
+	if(fstat(fd,&info)==0 && S_ISREG(info.st_mode) && result!=info.st_size) {
+		printf("WARNING: fs_handle_copyin only wrote %lld bytes, not %lld bytes\n",(long long)result,(long long)info.st_size);
+		fs_close(handle);
+		close(fd);
+		return 0;
+	}
+
+	fs_close(handle);
+	close(fd);
+	return 1;
+}
+
+static int do_copyout( int snapid, int inumber, const char *filename )
+{
+	struct fs_handle *handle = 0;
+	int64_t offset=0, size=0;
+	int result, fd, short_copy=0;
 	char buffer[16384];
 
-	file = fopen(filename,"r");
-	if(!file) {
+	// snapshots are read by inumber, the live filesystem through a handle
+	if(snapid==0) {
+		handle = fs_open(inumber);
+		if(!handle) return 0;
+	}
+
+	// anything already printed goes out before the file does
+	fflush(stdout);
+
+	fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd<0) {
 		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fs_close(handle);
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
-		if(result<=0) break;
-		if(result>0) {
-			actual = fs_write(inumber,buffer,result,offset);
-			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+	if(handle) {
+		size = fs_getsize(inumber);
+		offset = fs_handle_copyout(handle,fd,INT64_MAX);
+		if(offset<0) offset = 0;
+		short_copy = offset!=size;
+	} else {
+		while(1) {
+			result = fs_snapshot_read(snapid,inumber,buffer,sizeof(buffer),offset);
+			if(result<=0) {
+				short_copy = result<0;
 				break;
 			}
-			offset += actual;
-			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+			if(write(fd,buffer,result)!=result) {
+				short_copy = 1;
 				break;
 			}
+			offset += result;
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	printf("%lld bytes copied\n",(long long)offset);
+
+	fs_close(handle);
+	close(fd);
 
-	fclose(file);
+	if(short_copy) {
+		printf("WARNING: only %lld bytes of inode %d could be copied\n",(long long)offset,inumber);
+		return 0;
+	}
 	return 1;
 }
 
-static int do_copyout( int inumber, const char *filename )
+
+/*
+The stress command runs the same create/write/read/verify/delete workload
+with 1, 2, 4 ... maxthreads threads, splitting a fixed number of files
+between them, and reports throughput and any data that did not read back
+the way it was written.
+*/
+
+struct stress_worker {
+	pthread_t thread;
+	int id;
+	int nfiles;
+	int size;
+	long bytes;
+	int errors;
+};
+
+static void stress_fill( char *buffer, int size, unsigned seed )
 {
-	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int i;
+	for(i=0;i<size;i++) {
+		seed = seed*1103515245+12345;
+		buffer[i] = seed>>16;
+	}
+}
 
-	file = fopen(filename,"w");
-	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
+static void *stress_run( void *arg )
+{
+	struct stress_worker *w = arg;
+	char *expect = malloc(w->size);
+	char *actual = malloc(w->size);
+	int i, inumber, chunk, offset;
+
+	if(!expect || !actual) {
+		w->errors++;
+		free(expect);
+		free(actual);
+		return 0;
+	}
+
+	for(i=0;i<w->nfiles;i++) {
+		inumber = fs_create();
+		if(inumber<=0) {
+			w->errors++;
+			continue;
+		}
+
+		stress_fill(expect,w->size,w->id*7919+i);
+
+		// write in uneven chunks so partial blocks get exercised too
+		for(offset=0;offset<w->size;offset+=chunk) {
+			chunk = 5000;
+			if(chunk>w->size-offset) chunk = w->size-offset;
+			if(fs_write(inumber,expect+offset,chunk,offset)!=chunk) {
+				w->errors++;
+				break;
+			}
+		}
+
+		if(fs_read(inumber,actual,w->size,0)!=w->size || memcmp(expect,actual,w->size)) {
+			printf("stress: thread %d: inode %d did not read back correctly\n",w->id,inumber);
+			w->errors++;
+		}
+
+		fs_delete(inumber);
+		w->bytes += 2L*w->size;
+	}
+
+	free(expect);
+	free(actual);
+	return 0;
+}
+
+static int do_stress( int maxthreads, int size, int nfiles )
+{
+	struct stress_worker *workers;
+	struct timespec start, stop;
+	int nthreads, i, errors=0;
+	long bytes;
+	double elapsed;
+
+	if(maxthreads<1 || size<1 || nfiles<1) {
+		printf("stress: thread count, file size and file count must be positive\n");
 		return 0;
 	}
 
+	workers = calloc(maxthreads,sizeof(*workers));
+	if(!workers) return 0;
+
+	nthreads = 1;
 	while(1) {
-		result = fs_read(inumber,buffer,sizeof(buffer),offset);
-		if(result<=0) break;
-		fwrite(buffer,1,result,file);
-		offset += result;
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(i=0;i<nthreads;i++) {
+			memset(&workers[i],0,sizeof(workers[i]));
+			workers[i].id = i;
+			workers[i].size = size;
+			workers[i].nfiles = nfiles/nthreads + (i<nfiles%nthreads);
+			pthread_create(&workers[i].thread,0,stress_run,&workers[i]);
+		}
+
+		bytes = 0;
+		for(i=0;i<nthreads;i++) {
+			pthread_join(workers[i].thread,0);
+			bytes += workers[i].bytes;
+			errors += workers[i].errors;
+		}
+		clock_gettime(CLOCK_MONOTONIC,&stop);
+
+		elapsed = (stop.tv_sec-start.tv_sec) + (stop.tv_nsec-start.tv_nsec)/1e9;
+		printf("%3d threads: %d files in %.3f s, %.1f files/s, %.2f MB/s\n",
+			nthreads,nfiles,elapsed,nfiles/elapsed,bytes/elapsed/1e6);
+
+		if(nthreads==maxthreads) break;
+		nthreads = nthreads*2<maxthreads ? nthreads*2 : maxthreads;
+	}
+
+	free(workers);
+
+	printf("%d errors\n",errors);
+	return errors==0;
+}
+
+/*
+crcbench times the checksum kernels on their own, then reads the disk
+sequentially with and without checksumming each block, to show what
+verification costs a sequential read.  The reads come from the page
+cache, so this is the worst case: there a 4 KB read costs about as much
+as checksumming it, and verifying adds 20-40% to the time.  Reads that
+reach a real disk hide most of it.  The plain and checked passes take
+turns and the best of each is kept, since single passes vary a lot.
+*/
+
+#define CRCBENCH_ROUNDS 5
+
+static double elapsed_since( struct timespec *start )
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (now.tv_sec-start->tv_sec) + (now.tv_nsec-start->tv_nsec)/1e9;
+}
+
+static int do_crcbench( int nblocks )
+{
+	struct timespec start;
+	char *buffer;
+	double seconds, plain, checked, mb;
+	uint32_t crc = 0;
+	int i, pass;
+
+	if(nblocks<1 || nblocks>disk_size()) {
+		printf("crcbench: block count must be between 1 and %lld\n",(long long)disk_size());
+		return 0;
+	}
+
+	buffer = malloc((size_t)nblocks*DISK_BLOCK_SIZE);
+	if(!buffer) return 0;
+
+	mb = (double)nblocks*DISK_BLOCK_SIZE/1e6;
+	stress_fill(buffer,nblocks*DISK_BLOCK_SIZE,1);
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	for(i=0;i<nblocks;i++) crc ^= crc32c_sw(0,buffer+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+	printf("crc32c software: %8.1f MB/s\n",mb/elapsed_since(&start));
+
+	if(crc32c_hw_available()) {
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(i=0;i<nblocks;i++) crc ^= crc32c_hw(0,buffer+(size_t)i*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE);
+		printf("crc32c sse4.2:   %8.1f MB/s\n",mb/elapsed_since(&start));
+	} else {
+		printf("crc32c sse4.2:   not available on this processor\n");
+	}
+
+	// the first pass warms the page cache so every timed pass sees the same disk
+	plain = checked = 0;
+	for(pass=0;pass<=2*CRCBENCH_ROUNDS;pass++) {
+		clock_gettime(CLOCK_MONOTONIC,&start);
+		for(i=0;i<nblocks;i++) {
+			disk_read(i,buffer);
+			if(pass>0 && pass%2==0) crc ^= crc32c(0,buffer,DISK_BLOCK_SIZE);
+		}
+		seconds = elapsed_since(&start);
+		if(pass>0 && pass%2==1 && (!plain || seconds<plain)) plain = seconds;
+		if(pass>0 && pass%2==0 && (!checked || seconds<checked)) checked = seconds;
+	}
+
+	printf("sequential read:          %8.1f MB/s\n",mb/plain);
+	printf("sequential read + crc32c: %8.1f MB/s (%+.1f%% time)\n",mb/checked,100.0*(checked-plain)/plain);
+	printf("(checksum %08x)\n",crc);
+
+	free(buffer);
+	return 1;
+}
+
+/*
+Batch mode runs a script without prompts and reports how long each
+script line took.  Blank lines and lines starting with # are ignored.
+A command ending in xN is run N times, and one ending in xA..B is run
+for A through B; %i in its arguments becomes the current count.
+"repeat N" ... "end" runs the enclosed lines N times, and %l in them
+becomes the current pass.  For example:
+
+	format
+	mount
+	repeat 10
+	create x100
+	copyin data.txt %i x1..100
+	delete %i x1..100
+	end
+
+Command output is thrown away unless -v is given, in which case it goes
+to stderr; the report goes to stdout as text, csv or json.
+*/
+
+struct batch_line {
+	char text[1024];
+	int lineno;
+	int loop;
+	int match;
+	long ops;
+	long failures;
+	double seconds;
+	long reads;
+	long writes;
+};
+
+static void batch_expand( const char *in, char *out, int size, int i, int l )
+{
+	int n = 0;
+
+	while(*in && n<size-16) {
+		if(in[0]=='%' && in[1]=='i') {
+			n += sprintf(out+n,"%d",i);
+			in += 2;
+		} else if(in[0]=='%' && in[1]=='l') {
+			n += sprintf(out+n,"%d",l);
+			in += 2;
+		} else {
+			out[n++] = *in++;
+		}
+	}
+	out[n] = 0;
+}
+
+/*
+Split a trailing xN or xA..B off a command, leaving the rest in command.
+*/
+
+static void batch_count( const char *text, char *command, int *first, int *last )
+{
+	const char *word = strrchr(text,' ');
+	int a, b, n;
+
+	strcpy(command,text);
+	*first = *last = 1;
+
+	if(!word || word[1]!='x') return;
+	word += 2;
+
+	if(sscanf(word,"%d..%d%n",&a,&b,&n)==2 && !word[n]) {
+		*first = a;
+		*last = b;
+	} else if(sscanf(word,"%d%n",&b,&n)==1 && !word[n]) {
+		*last = b;
+	} else {
+		return;
 	}
+	command[word-2-text] = 0;
+}
+
+static int batch_exec( struct batch_line *lines, int first, int last, int pass )
+{
+	struct timespec start;
+	struct batch_line *b;
+	char command[1024];
+	char expanded[1024];
+	int64_t reads, writes;
+	int i, j, from, to, result;
+
+	for(i=first;i<last;i++) {
+		b = &lines[i];
+
+		if(b->loop) {
+			for(j=1;j<=b->loop;j++) {
+				if(!batch_exec(lines,i+1,b->match,j)) return 0;
+			}
+			i = b->match;
+			continue;
+		}
 
-	printf("%d bytes copied\n",offset);
+		batch_count(b->text,command,&from,&to);
+
+		reads = disk_reads();
+		writes = disk_writes();
+		clock_gettime(CLOCK_MONOTONIC,&start);
+
+		for(j=from;j<=to;j++) {
+			batch_expand(command,expanded,sizeof(expanded),j,pass);
+			result = run_command(expanded);
+			if(result<0) return 0;
+			if(result==0) b->failures++;
+			b->ops++;
+		}
+
+		fflush(stdout);
+		b->seconds += elapsed_since(&start);
+		b->reads += disk_reads()-reads;
+		b->writes += disk_writes()-writes;
+	}
 
-	fclose(file);
 	return 1;
 }
 
+static void batch_quote( FILE *out, const char *text, int json )
+{
+	unsigned char c;
+
+	fputc('"',out);
+	for(;*text;text++) {
+		c = *text;
+		if(json && c<0x20) {
+			if(c=='\t') fputs("\\t",out);
+			else if(c=='\n') fputs("\\n",out);
+			else if(c=='\r') fputs("\\r",out);
+			else fprintf(out,"\\u%04x",c);
+			continue;
+		}
+		if(c=='"') fputc(json ? '\\' : '"',out);
+		if(c=='\\' && json) fputc('\\',out);
+		fputc(c,out);
+	}
+	fputc('"',out);
+}
+
+static void batch_report( FILE *out, struct batch_line *lines, int nlines, const char *format )
+{
+	struct batch_line total;
+	struct batch_line *b;
+	int i, first = 1;
+
+	memset(&total,0,sizeof(total));
+	strcpy(total.text,"total");
+
+	if(!strcmp(format,"csv")) {
+		fprintf(out,"line,command,ops,failures,seconds,ops_per_sec,disk_reads,disk_writes\n");
+	} else if(!strcmp(format,"json")) {
+		fprintf(out,"[\n");
+	} else {
+		fprintf(out,"%5s %-32s %8s %6s %10s %12s %10s %10s\n","line","command","ops","failed","seconds","ops/s","reads","writes");
+	}
+
+	for(i=0;i<=nlines;i++) {
+		if(i<nlines) {
+			b = &lines[i];
+			if(b->loop || b->match<0) continue;
+			total.ops += b->ops;
+			total.failures += b->failures;
+			total.seconds += b->seconds;
+			total.reads += b->reads;
+			total.writes += b->writes;
+		} else {
+			b = &total;
+		}
+
+		double rate = b->seconds>0 ? b->ops/b->seconds : 0;
+
+		if(!strcmp(format,"csv")) {
+			fprintf(out,"%d,",b->lineno);
+			batch_quote(out,b->text,0);
+			fprintf(out,",%ld,%ld,%.6f,%.1f,%ld,%ld\n",b->ops,b->failures,b->seconds,rate,b->reads,b->writes);
+		} else if(!strcmp(format,"json")) {
+			fprintf(out,"%s  {\"line\": %d, \"command\": ",first ? "" : ",\n",b->lineno);
+			batch_quote(out,b->text,1);
+			fprintf(out,", \"ops\": %ld, \"failures\": %ld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, \"disk_reads\": %ld, \"disk_writes\": %ld}",
+				b->ops,b->failures,b->seconds,rate,b->reads,b->writes);
+		} else {
+			fprintf(out,"%5d %-32.32s %8ld %6ld %10.4f %12.1f %10ld %10ld\n",b->lineno,b->text,b->ops,b->failures,b->seconds,rate,b->reads,b->writes);
+		}
+		first = 0;
+	}
+
+	if(!strcmp(format,"json")) fprintf(out,"\n]\n");
+}
+
+static int do_batch( const char *script, const char *format, int verbose )
+{
+	struct batch_line *lines = 0;
+	char text[1024];
+	int nlines = 0, alloced = 0, lineno = 0, depth = 0, i, j, saved, null, result;
+	int *stack;
+	FILE *file, *report;
+	char *p;
+
+	file = strcmp(script,"-") ? fopen(script,"r") : stdin;
+	if(!file) {
+		fprintf(stderr,"couldn't open %s: %s\n",script,strerror(errno));
+		return 0;
+	}
+
+	while(fgets(text,sizeof(text),file)) {
+		lineno++;
+		text[strcspn(text,"\r\n")] = 0;
+		for(p=text;*p==' ' || *p=='\t';p++) {}
+		if(!*p || *p=='#') continue;
+
+		if(nlines==alloced) {
+			alloced = alloced ? alloced*2 : 64;
+			lines = realloc(lines,alloced*sizeof(*lines));
+			if(!lines) return 0;
+		}
+		memset(&lines[nlines],0,sizeof(lines[nlines]));
+		strcpy(lines[nlines].text,p);
+		lines[nlines].lineno = lineno;
+		nlines++;
+	}
+	if(file!=stdin) fclose(file);
+
+	// match each repeat with its end
+	stack = malloc((nlines+1)*sizeof(int));
+	result = stack!=0;
+	for(i=0;result && i<nlines;i++) {
+		if(!strncmp(lines[i].text,"repeat ",7)) {
+			lines[i].loop = atoi(lines[i].text+7);
+			if(lines[i].loop<1) {
+				fprintf(stderr,"%s:%d: repeat count must be positive\n",script,lines[i].lineno);
+				result = 0;
+			}
+			stack[depth++] = i;
+		} else if(!strcmp(lines[i].text,"end")) {
+			if(!depth) {
+				fprintf(stderr,"%s:%d: end without repeat\n",script,lines[i].lineno);
+				result = 0;
+				break;
+			}
+			j = stack[--depth];
+			lines[j].match = i;
+			lines[i].match = -1;
+		}
+	}
+	if(result && depth) {
+		fprintf(stderr,"%s:%d: repeat without end\n",script,lines[stack[depth-1]].lineno);
+		result = 0;
+	}
+	free(stack);
+
+	if(!result) {
+		free(lines);
+		return 0;
+	}
+
+	// keep the report on stdout and send command output elsewhere
+	fflush(stdout);
+	saved = dup(1);
+	null = verbose ? dup(2) : open("/dev/null",O_WRONLY);
+	if(saved<0 || null<0) {
+		free(lines);
+		return 0;
+	}
+	dup2(null,1);
+	close(null);
+
+	batch_exec(lines,0,nlines,1);
+
+	fflush(stdout);
+	report = fdopen(saved,"w");
+	batch_report(report,lines,nlines,format);
+	fclose(report);
+
+	free(lines);
+	return 1;
+}
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Corrupt metadata on a checksummed image and check that operations on
+# the damaged file fail cleanly, while the rest of the image still works.
+#
+# use: tests/checksums.sh [path-to-simplefs]
+
+SIMPLEFS=${1:-./simplefs}
+DIR=$(mktemp -d)
+IMAGE=$DIR/image
+BLOCKS=1000
+failures=0
+
+trap 'rm -rf "$DIR"' EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	failures=$((failures+1))
+}
+
+run()
+{
+	printf "$1" | "$SIMPLEFS" "$IMAGE" $BLOCKS > "$DIR/out" 2>&1
+	status=$?
+	if [ $status -gt 1 ]; then
+		fail "simplefs exited with status $status"
+		cat "$DIR/out"
+	fi
+}
+
+expect()
+{
+	grep -q -- "$1" "$DIR/out" || fail "expected '$1'"
+}
+
+reject()
+{
+	grep -q -- "$1" "$DIR/out" && fail "did not expect '$1'"
+}
+
+# overwrite bytes at an offset within a block of the image
+corrupt()
+{
+	printf '\177\177\177\177' | dd of="$IMAGE" bs=1 seek=$(($1*4096+$2)) conv=notrunc 2>/dev/null
+}
+
+# two files big enough to need an indirect block each
+head -c 100000 /dev/urandom > "$DIR/data"
+run "format checksums snapshots\nmount\ncreate\ncopyin $DIR/data 1\ncreate\ncopyin $DIR/data 2\nsnapshot create\ndebug\n"
+expect "created snapshot 1"
+indirect=$(sed -n '/^inode 1:/,/^inode 2:/s/.*indirect block: //p' "$DIR/out" | head -n 1)
+[ -n "$indirect" ] || fail "no indirect block for inode 1"
+cp "$IMAGE" "$DIR/clean"
+
+# a damaged indirect block: reads, writes, deletes and snapshots of the
+# file fail instead of following its pointers
+corrupt "$indirect" 40
+run "mount\ncopyout 1 $DIR/out1\ncopyin $DIR/data 1\ndelete 1\nsnapshot create\nsnapshot delete 1\nsnapshot copyout 1 1 $DIR/out1\ncopyout 2 $DIR/out2\n"
+expect "checksum mismatch in block $indirect"
+reject "copied inode 1 to"
+reject "copied file $DIR/data to inode 1"
+reject "inode 1 deleted"
+reject "created snapshot 2"
+reject "snapshot 1 deleted"
+reject "copied inode 1 of snapshot 1"
+expect "copied inode 2 to"
+cmp -s "$DIR/data" "$DIR/out2" || fail "inode 2 did not survive a damaged neighbour"
+
+# a damaged inode block: the inode's size and pointers are never used
+cp "$DIR/clean" "$IMAGE"
+rm -f "$DIR/out1"
+corrupt 1 36
+run "mount\ncopyout 1 $DIR/out1\ncopyin $DIR/data 1\ndelete 1\ncreate\nsnapshot create\n"
+expect "checksum mismatch in block 1"
+reject "bytes copied"
+reject "inode 1 deleted"
+reject "created inode"
+reject "created snapshot 2"
+[ -s "$DIR/out1" ] && fail "copyout wrote data from a damaged inode"
+
+if [ $failures -ne 0 ]; then
+	echo "$failures checks failed"
+	exit 1
+fi
+echo "checksum tests passed"
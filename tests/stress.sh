@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Run the shell's threaded stress workload on each feature set and check
+# that every file read back the way it was written, that a file left on
+# the image beforehand survives it, and that fsck finds the image clean.
+#
+# use: tests/stress.sh [path-to-simplefs]
+
+SIMPLEFS=${1:-./simplefs}
+DIR=$(mktemp -d)
+IMAGE=$DIR/image
+BLOCKS=4000
+THREADS=8
+failures=0
+
+trap 'rm -rf "$DIR"' EXIT
+
+fail()
+{
+	echo "FAIL: $*"
+	failures=$((failures+1))
+}
+
+run()
+{
+	printf "$1" | "$SIMPLEFS" "$IMAGE" $BLOCKS > "$DIR/out" 2>&1
+	status=$?
+	if [ $status -gt 1 ]; then
+		fail "simplefs exited with status $status"
+		cat "$DIR/out"
+	fi
+}
+
+expect()
+{
+	grep -q -- "$1" "$DIR/out" || fail "${features:-no features}: expected '$1'"
+}
+
+reject()
+{
+	grep -q -- "$1" "$DIR/out" && fail "${features:-no features}: did not expect '$1'"
+}
+
+head -c 100000 /dev/urandom > "$DIR/data"
+
+for features in "" dedup snapshots dirs checksums large "dedup snapshots dirs checksums large"; do
+	rm -f "$IMAGE" "$DIR/kept"
+	snapshot=
+	case "$features" in
+	*snapshots*) snapshot="snapshot create\n" ;;
+	esac
+	run "format $features\nmount\ncreate\n"
+	kept=$(sed -n 's/.*created inode //p' "$DIR/out")
+	[ -n "$kept" ] || fail "${features:-no features}: could not create a file"
+	run "mount\ncopyin $DIR/data $kept\n${snapshot}stress $THREADS 70000 64\ncopyout $kept $DIR/kept\nfsck\n"
+	expect "threads: 64 files"
+	expect "^0 errors"
+	reject "did not read back"
+	reject "stress failed"
+	expect "fsck: 0 problems found"
+	cmp -s "$DIR/data" "$DIR/kept" || fail "${features:-no features}: inode $kept changed under the stress workload"
+	if [ $failures -ne 0 ]; then
+		cat "$DIR/out"
+		break
+	fi
+done
+
+if [ $failures -ne 0 ]; then
+	echo "$failures checks failed"
+	exit 1
+fi
+echo "stress tests passed"